@@ -0,0 +1,280 @@
+// # Result Cache
+//
+// Results of the `--quiet` runs are stored on disk, one file per run, keyed by the hash of the
+// entry state, the initial tape and the compiled rules the run can reach from them. A rule is
+// reachable if its state is the entry state or the next state of a reachable rule and its symbol
+// is on the initial tape or written by a reachable rule. Everything is hashed by the text of the
+// symbols rather than their ids, so the key does not depend on the order the symbols were
+// interned in or on the unrelated rules and runs in the same file.
+
+#define CACHE_MAGIC "TURJ"
+#define CACHE_VERSION 2
+
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} Cache_Key;
+
+typedef struct {
+    const char *dir;
+    const Machine *m;
+    uint64_t *states_hash;
+    uint64_t *alphabet_hash;
+} Cache;
+
+void cache_init(Cache *c, const char *dir, const Machine *m)
+{
+    c->dir = dir;
+    c->m = m;
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        printf("WARNING: could not create cache directory %s: %s\n", dir, strerror(errno));
+    }
+
+    c->states_hash = malloc(m->states.count*sizeof(*c->states_hash));
+    c->alphabet_hash = malloc(m->alphabet.count*sizeof(*c->alphabet_hash));
+    assert(c->states_hash != NULL && "Buy more RAM lol");
+    assert(c->alphabet_hash != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < m->states.count; ++i) c->states_hash[i] = sv_hash(m->states.data[i]);
+    for (size_t i = 0; i < m->alphabet.count; ++i) c->alphabet_hash[i] = sv_hash(m->alphabet.data[i]);
+}
+
+void cache_free(Cache *c)
+{
+    free(c->states_hash);
+    free(c->alphabet_hash);
+}
+
+typedef struct {
+    Symbol_Id *data;
+    size_t count;
+    size_t capacity;
+    bool *seen;
+} Cache_Reached;
+
+static void cache_reach(Cache_Reached *reached, Symbol_Id id)
+{
+    if (reached->seen[id]) return;
+    reached->seen[id] = true;
+    da_append(reached, id);
+}
+
+// Sums up the hashes of the transitions reachable by the run. The sum does not depend on the
+// order they were reached in.
+static uint64_t cache_program_hash(const Cache *c, const Exec *e)
+{
+    const Machine *m = c->m;
+    Cache_Reached states = { .seen = calloc(m->states.count, sizeof(bool)) };
+    Cache_Reached symbols = { .seen = calloc(m->alphabet.count, sizeof(bool)) };
+    assert(states.seen != NULL && symbols.seen != NULL && "Buy more RAM lol");
+    cache_reach(&states, e->state);
+    cache_reach(&symbols, e->init);
+    for (size_t i = 0; i < exec_tape_count(e); ++i) cache_reach(&symbols, exec_cell(e, i));
+
+    // Every (state, symbol) is visited exactly once, when the later of the two is reached
+    uint64_t hash = 0;
+    size_t states_done = 0;
+    size_t symbols_done = 0;
+    while (states_done < states.count || symbols_done < symbols.count) {
+        bool state_first = states_done < states.count;
+        Symbol_Id id = state_first ? states.data[states_done++] : symbols.data[symbols_done++];
+        size_t count = state_first ? symbols_done : states_done;
+        for (size_t i = 0; i < count; ++i) {
+            Symbol_Id state = state_first ? id : states.data[i];
+            Symbol_Id read = state_first ? symbols.data[i] : id;
+            Transition t = *machine_transition(m, state, read);
+            if (!(t.flags&TF_DEFINED)) continue;
+            cache_reach(&states, t.next);
+            cache_reach(&symbols, t.write);
+
+            uint64_t h = c->states_hash[state];
+            h = mix64(h ^ c->alphabet_hash[read]);
+            h = mix64(h ^ c->alphabet_hash[t.write]);
+            h = mix64(h ^ (uint64_t) (t.step + 2));
+            h = mix64(h ^ c->states_hash[t.next]);
+            hash += h;
+        }
+    }
+
+    free(states.data);
+    free(states.seen);
+    free(symbols.data);
+    free(symbols.seen);
+    return hash;
+}
+
+Cache_Key cache_key(const Cache *c, const Exec *e)
+{
+    uint64_t program_hash = cache_program_hash(c, e);
+    Cache_Key key = {
+        .lo = mix64(program_hash ^ 0x5555555555555555ULL),
+        .hi = mix64(program_hash ^ 0xaaaaaaaaaaaaaaaaULL),
+    };
+    key.lo = mix64(key.lo ^ c->states_hash[e->state]);
+    key.hi = mix64(key.hi + c->states_hash[e->state]*0x9e3779b97f4a7c15ULL);
+    key.lo = mix64(key.lo ^ c->alphabet_hash[e->init]);
+    key.hi = mix64(key.hi + c->alphabet_hash[e->init]*0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < exec_tape_count(e); ++i) {
+        uint64_t h = c->alphabet_hash[exec_cell(e, i)];
+        key.lo = mix64(key.lo ^ h);
+        key.hi = mix64(key.hi + h*0x9e3779b97f4a7c15ULL);
+    }
+    return key;
+}
+
+static void cache_path(const Cache *c, Cache_Key key, String_Builder *sb)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/%016"PRIx64"%016"PRIx64".turjc", key.hi, key.lo);
+    sb->count = 0;
+    sb_append_cstr(sb, c->dir);
+    sb_append_cstr(sb, name);
+    sb_append_null(sb);
+}
+
+static bool read_u32(FILE *f, uint32_t *x) { return fread(x, sizeof(*x), 1, f) == 1; }
+static bool read_u64(FILE *f, uint64_t *x) { return fread(x, sizeof(*x), 1, f) == 1; }
+static void write_u32(FILE *f, uint32_t x) { fwrite(&x, sizeof(x), 1, f); }
+static void write_u64(FILE *f, uint64_t x) { fwrite(&x, sizeof(x), 1, f); }
+
+static void write_sv(FILE *f, String_View sv)
+{
+    write_u32(f, sv.count);
+    fwrite(sv.data, sv.count, 1, f);
+}
+
+static bool read_sv(FILE *f, String_Builder *sb)
+{
+    uint32_t count;
+    if (!read_u32(f, &count)) return false;
+    sb->count = 0;
+    for (uint32_t i = 0; i < count; ++i) da_append(sb, '\0');
+    return count == 0 || fread(sb->data, count, 1, f) == 1;
+}
+
+// Replaces the configuration of `e` with the cached final one. Returns false on a miss.
+bool cache_load(const Cache *c, Cache_Key key, Exec *e, Exec_Status *status)
+{
+    bool result = true;
+    String_Builder path = {0};
+    String_Builder name = {0};
+    Cells symbols = {0};
+    Cells tape = {0};
+    FILE *f = NULL;
+
+    cache_path(c, key, &path);
+    f = fopen(path.data, "rb");
+    if (f == NULL) return_defer(false);
+
+    char magic[4];
+    uint32_t version;
+    Cache_Key stored;
+    if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0) return_defer(false);
+    if (!read_u32(f, &version) || version != CACHE_VERSION) return_defer(false);
+    if (!read_u64(f, &stored.lo) || !read_u64(f, &stored.hi)) return_defer(false);
+    if (stored.lo != key.lo || stored.hi != key.hi) return_defer(false);
+
+    uint32_t status_;
+    uint64_t steps, head;
+    if (!read_u32(f, &status_) || !read_u64(f, &steps) || !read_u64(f, &head)) return_defer(false);
+
+    Symbol_Id state;
+    if (!read_sv(f, &name) || !symbols_find(&c->m->states, sb_to_sv(name), &state)) return_defer(false);
+
+    // The tape refers to the symbols by their index in the file, since the ids are local to
+    // the current Machine
+    uint32_t symbols_count;
+    if (!read_u32(f, &symbols_count)) return_defer(false);
+    for (uint32_t i = 0; i < symbols_count; ++i) {
+        Symbol_Id id;
+        if (!read_sv(f, &name) || !symbols_find(&c->m->alphabet, sb_to_sv(name), &id)) return_defer(false);
+        da_append(&symbols, id);
+    }
+
+    uint64_t count;
+    if (!read_u64(f, &count)) return_defer(false);
+    for (uint64_t i = 0; i < count; ++i) {
+        uint32_t index;
+        if (!read_u32(f, &index) || index >= symbols.count) return_defer(false);
+        da_append(&tape, symbols.data[index]);
+    }
+
+    // The spilled tape can not grow past its mapping, so the result that does not fit into it is
+    // not loaded and the run goes past the reserved cells the same way it does without the cache
+    if (e->spilled && tape.count > e->tape.capacity) return_defer(false);
+    exec_widen(e);
+    if (e->spilled) {
+        memcpy(e->tape.data, tape.data, tape.count*sizeof(*tape.data));
+        e->tape.count = tape.count;
+    } else {
+        e->tape.count = 0;
+        da_append_many(&e->tape, tape.data, tape.count);
+    }
+    e->state = state;
+    e->head = head;
+    e->steps = steps;
+    *status = (Exec_Status) status_;
+
+defer:
+    if (f) fclose(f);
+    free(path.data);
+    free(name.data);
+    free(symbols.data);
+    free(tape.data);
+    return result;
+}
+
+void cache_store(const Cache *c, Cache_Key key, const Exec *e, Exec_Status status)
+{
+    String_Builder path = {0};
+    String_Builder tmp_path = {0};
+    cache_path(c, key, &path);
+    sb_append_buf(&tmp_path, path.data, path.count - 1);
+    char suffix[32];
+    snprintf(suffix, sizeof(suffix), ".%ld.tmp", (long) getpid());
+    sb_append_cstr(&tmp_path, suffix);
+    sb_append_null(&tmp_path);
+
+    FILE *f = fopen(tmp_path.data, "wb");
+    if (f == NULL) {
+        printf("WARNING: could not write cache file %s: %s\n", tmp_path.data, strerror(errno));
+        goto defer;
+    }
+
+    fwrite(CACHE_MAGIC, 4, 1, f);
+    write_u32(f, CACHE_VERSION);
+    write_u64(f, key.lo);
+    write_u64(f, key.hi);
+    write_u32(f, status);
+    write_u64(f, e->steps);
+    write_u64(f, e->head);
+    write_sv(f, c->m->states.data[e->state]);
+
+    uint32_t *index = malloc(c->m->alphabet.count*sizeof(*index));
+    assert(index != NULL && "Buy more RAM lol");
+    memset(index, 0xFF, c->m->alphabet.count*sizeof(*index));
+    size_t count = exec_tape_count(e);
+    for (size_t i = 0; i < count; ++i) index[exec_cell(e, i)] = 0;
+    uint32_t symbols_count = 0;
+    for (Symbol_Id id = 0; id < c->m->alphabet.count; ++id) {
+        if (index[id] != UINT32_MAX) index[id] = symbols_count++;
+    }
+    write_u32(f, symbols_count);
+    for (Symbol_Id id = 0; id < c->m->alphabet.count; ++id) {
+        if (index[id] != UINT32_MAX) write_sv(f, c->m->alphabet.data[id]);
+    }
+    write_u64(f, count);
+    for (size_t i = 0; i < count; ++i) write_u32(f, index[exec_cell(e, i)]);
+    free(index);
+
+    bool failed = ferror(f);
+    fclose(f);
+    // Renaming is atomic, so the concurrent jobs sharing the cache never see a partial file
+    if (failed || rename(tmp_path.data, path.data) < 0) {
+        printf("WARNING: could not write cache file %s: %s\n", path.data, strerror(errno));
+        remove(tmp_path.data);
+    }
+
+defer:
+    free(path.data);
+    free(tmp_path.data);
+}
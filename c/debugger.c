@@ -0,0 +1,175 @@
+// # Step Debugger
+//
+// Entered whenever a run with `#break`/`#watch` commands stops. Reads the commands from stdin.
+
+#define DEBUGGER_DEFAULT_RADIUS 10
+
+void print_tape_window(const Exec *e, size_t radius)
+{
+    size_t begin = e->head > radius ? e->head - radius : 0;
+    size_t end = e->head + radius + 1;
+    if (end > e->tape.count) end = e->tape.count;
+
+    String_Builder sb = {0};
+    String_View state = e->m->states.data[e->state];
+    sb_append_buf(&sb, state.data, state.count);
+    sb_append_cstr(&sb, ":");
+    if (begin > 0) sb_append_cstr(&sb, " ...");
+
+    size_t head_start = 0;
+    size_t head_end = 0;
+    for (size_t i = begin; i < end; ++i) {
+        String_View it = e->m->alphabet.data[e->tape.data[i]];
+        if (i == e->head) head_start = sb.count + 1;
+        sb_append_cstr(&sb, " ");
+        sb_append_buf(&sb, it.data, it.count);
+        if (i == e->head) head_end = sb.count;
+    }
+    if (end < e->tape.count) sb_append_cstr(&sb, " ...");
+    printf(SB_Fmt"\n", SB_Arg(sb));
+    printf("%*s", (int) head_start, "");
+    for (size_t i = head_start; i < head_end; ++i) printf("^");
+    printf("\n");
+    free(sb.data);
+}
+
+void print_exec_state(const Exec *e)
+{
+    String_View state = e->m->states.data[e->state];
+    printf("state: "SV_Fmt", head: %zu, step: %"PRIu64", tape: %zu cells\n",
+           SV_Arg(state), e->head, e->steps, e->tape.count);
+}
+
+static void debugger_help(void)
+{
+    printf("  s, step [N]      perform N steps (default 1)\n");
+    printf("  b, back [N]      revert N steps (default 1)\n");
+    printf("  g, goto N        go to the step N, either forward or backward\n");
+    printf("  c, continue      run until the next breakpoint or watch\n");
+    printf("  t, tape [W]      print the tape within W cells around the head (default %d)\n", DEBUGGER_DEFAULT_RADIUS);
+    printf("  p, state         print the current state, head position and step count\n");
+    printf("  q, quit          stop the run\n");
+    printf("  h, help          print this help\n");
+}
+
+typedef enum {
+    DEBUGGER_CONTINUE,
+    DEBUGGER_QUIT,
+    DEBUGGER_DETACH,
+} Debugger_Action;
+
+static bool exec_status_halted(Exec_Status status)
+{
+    return status == EXEC_HALT || status == EXEC_UNDERFLOW;
+}
+
+// Interacts with the user until they ask to continue or quit. `status` is updated whenever the
+// Machine is moved through time.
+Debugger_Action debugger_prompt(History *h, Exec *e, Exec_Status *status)
+{
+    char line[256];
+    while (true) {
+        printf("(turj) ");
+        fflush(stdout);
+        if (fgets(line, sizeof(line), stdin) == NULL) {
+            printf("\n");
+            return DEBUGGER_DETACH;
+        }
+
+        String_View args = sv_trim(sv_from_cstr(line));
+        String_View cmd = sv_trim(sv_chop_by_delim(&args, ' '));
+        args = sv_trim(args);
+
+        if (cmd.count == 0 || sv_eq(cmd, SV("s")) || sv_eq(cmd, SV("step"))) {
+            uint64_t n = args.count > 0 ? sv_to_u64(args) : 1;
+            if (exec_status_halted(*status)) {
+                printf("The Machine has halted. Use `back` or `goto` to look at the previous steps.\n");
+                continue;
+            }
+            *status = history_seek(h, e, e->steps + n);
+            exec_ensure_head(e);
+            print_tape_window(e, DEBUGGER_DEFAULT_RADIUS);
+            if (exec_status_halted(*status)) printf("-- HALT at step %"PRIu64" --\n", e->steps);
+        } else if (sv_eq(cmd, SV("b")) || sv_eq(cmd, SV("back"))) {
+            uint64_t n = args.count > 0 ? sv_to_u64(args) : 1;
+            *status = history_seek(h, e, e->steps > n ? e->steps - n : 0);
+            print_tape_window(e, DEBUGGER_DEFAULT_RADIUS);
+        } else if (sv_eq(cmd, SV("g")) || sv_eq(cmd, SV("goto"))) {
+            if (args.count == 0) {
+                printf("ERROR: `goto` expects the step number\n");
+                continue;
+            }
+            *status = history_seek(h, e, sv_to_u64(args));
+            exec_ensure_head(e);
+            print_tape_window(e, DEBUGGER_DEFAULT_RADIUS);
+            if (exec_status_halted(*status)) printf("-- HALT at step %"PRIu64" --\n", e->steps);
+        } else if (sv_eq(cmd, SV("c")) || sv_eq(cmd, SV("continue"))) {
+            return DEBUGGER_CONTINUE;
+        } else if (sv_eq(cmd, SV("t")) || sv_eq(cmd, SV("tape"))) {
+            size_t radius = args.count > 0 ? sv_to_u64(args) : DEBUGGER_DEFAULT_RADIUS;
+            print_tape_window(e, radius);
+        } else if (sv_eq(cmd, SV("p")) || sv_eq(cmd, SV("state"))) {
+            print_exec_state(e);
+        } else if (sv_eq(cmd, SV("q")) || sv_eq(cmd, SV("quit"))) {
+            return DEBUGGER_QUIT;
+        } else if (sv_eq(cmd, SV("h")) || sv_eq(cmd, SV("help"))) {
+            debugger_help();
+        } else {
+            printf("ERROR: unknown debugger command "SV_Fmt". Type `help` for the list of commands.\n", SV_Arg(cmd));
+        }
+    }
+}
+
+// Runs the Machine without tracing, stopping at breakpoints, watches and the halt.
+Exec_Status debug_run(Exec *e, const Watches *watches)
+{
+    History history = {0};
+    history_init(&history, e);
+
+    bool attached = true;
+    Exec_Status status = history_run(&history, e, UINT64_MAX, watches);
+    while (true) {
+        if (attached) {
+            exec_ensure_head(e);
+            switch (status) {
+            case EXEC_BREAK: printf("-- BREAK at step %"PRIu64" --\n", e->steps); break;
+            case EXEC_WATCH: printf("-- WATCH at step %"PRIu64" --\n", e->steps); break;
+            case EXEC_HALT:
+            case EXEC_UNDERFLOW: printf("-- HALT at step %"PRIu64" --\n", e->steps); break;
+            default: UNREACHABLE("Unexpected Exec_Status");
+            }
+            print_tape_window(e, DEBUGGER_DEFAULT_RADIUS);
+
+            switch (debugger_prompt(&history, e, &status)) {
+            case DEBUGGER_CONTINUE: break;
+            case DEBUGGER_QUIT: {
+                history_free(&history, e);
+                return EXEC_OK;
+            }
+            case DEBUGGER_DETACH: {
+                attached = false;
+                watches = NULL;
+            } break;
+            default: UNREACHABLE("Unexpected Debugger_Action");
+            }
+        }
+
+        if (exec_status_halted(status)) break;
+
+        // Step over the breakpoint we are currently standing on
+        exec_ensure_head(e);
+        status = EXEC_OK;
+        if (machine_transition(e->m, e->state, e->tape.data[e->head])->flags&TF_BREAK) {
+            status = exec_step(e);
+        }
+        if (status == EXEC_OK) status = history_run(&history, e, UINT64_MAX, watches);
+    }
+
+    if (!attached) {
+        exec_ensure_head(e);
+        print_tape_window(e, DEBUGGER_DEFAULT_RADIUS);
+    }
+
+    history_free(&history, e);
+    return status;
+}
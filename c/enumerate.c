@@ -0,0 +1,461 @@
+// # Machine Enumeration
+//
+// `turj enumerate` sweeps over all the Machines with the given amount of states and symbols in
+// the Tree Normal Form: every Machine starts with all of its transitions undefined and is run on
+// the blank tape. When it hits an undefined transition it is recorded as halting there and then
+// branches into all the possible definitions of that transition. The states and the symbols are
+// introduced in the order of their first use, so the Machines that differ only by renaming them
+// are never generated twice.
+//
+// The Machines are run with exactly the same semantics as `#run`: the tape is infinite only to the
+// right, the Machine halts if there is no rule for the current state and symbol or if it
+// underflows the tape. Symbol 0 is the blank and state A is the entry.
+
+#define ENUM_MAX_STATES 26
+#define ENUM_MAX_SYMBOLS 10
+#define ENUM_DEFAULT_STEPS 100000
+#define ENUM_TASKS_PER_THREAD 16
+#define ENUM_MAX_THREADS 1024
+
+typedef struct {
+    uint8_t write;
+    uint8_t next;
+    // 0 means the transition is undefined
+    int8_t step;
+} Enum_Transition;
+
+typedef struct {
+    Enum_Transition table[ENUM_MAX_STATES*ENUM_MAX_SYMBOLS];
+    uint8_t states_used;
+    uint8_t symbols_used;
+    uint16_t defined;
+} Enum_Machine;
+
+typedef struct {
+    Enum_Machine *data;
+    size_t count;
+    size_t capacity;
+} Enum_Machines;
+
+typedef enum {
+    ER_HALT,
+    ER_UNDEFINED,
+    ER_NONHALTING,
+    ER_HOLDOUT,
+} Enum_Result;
+
+typedef struct {
+    size_t states;
+    size_t symbols;
+    uint64_t steps_limit;
+
+    FILE *output;
+    pthread_mutex_t output_mutex;
+    atomic_uint_fast64_t champion;
+
+    Enum_Machines tasks;
+    atomic_size_t next_task;
+} Enumerator;
+
+typedef struct {
+    Enumerator *en;
+    uint8_t *tape;
+    // The configuration the current one is compared against to detect cycles
+    uint8_t *saved_tape;
+    // The tape at the time the saved record of the rightmost position was set
+    uint8_t *record_tape;
+    uint64_t enumerated;
+    uint64_t halting;
+    uint64_t nonhalting;
+    uint64_t holdouts;
+} Enum_Worker;
+
+static void enum_machine_display(const Enumerator *en, const Enum_Machine *em, char *buffer)
+{
+    for (size_t s = 0; s < en->states; ++s) {
+        if (s > 0) *buffer++ = '_';
+        for (size_t r = 0; r < en->symbols; ++r) {
+            Enum_Transition t = em->table[s*ENUM_MAX_SYMBOLS + r];
+            if (t.step == 0) {
+                memcpy(buffer, "---", 3);
+            } else {
+                buffer[0] = '0' + t.write;
+                buffer[1] = t.step < 0 ? 'L' : 'R';
+                buffer[2] = 'A' + t.next;
+            }
+            buffer += 3;
+        }
+    }
+    *buffer = '\0';
+}
+
+static void enum_report(Enum_Worker *w, const Enum_Machine *em, const char *kind, uint64_t steps)
+{
+    char buffer[ENUM_MAX_STATES*(ENUM_MAX_SYMBOLS*3 + 1) + 1];
+    enum_machine_display(w->en, em, buffer);
+    pthread_mutex_lock(&w->en->output_mutex);
+    fprintf(w->en->output, "%s %"PRIu64" %s\n", kind, steps, buffer);
+    pthread_mutex_unlock(&w->en->output_mutex);
+}
+
+// The Machine runs away to the right forever if, standing on a never visited cell in `state`, it
+// keeps reading blanks and moving right until it comes back to a state it has already been in.
+static void enum_compute_runaway(const Enumerator *en, const Enum_Machine *em, bool *runaway)
+{
+    for (size_t s = 0; s < en->states; ++s) {
+        bool seen[ENUM_MAX_STATES] = {0};
+        size_t state = s;
+        runaway[s] = false;
+        while (true) {
+            Enum_Transition t = em->table[state*ENUM_MAX_SYMBOLS];
+            if (t.step <= 0) break;
+            if (seen[state]) { runaway[s] = true; break; }
+            seen[state] = true;
+            state = t.next;
+        }
+    }
+}
+
+static Enum_Result enum_run(Enum_Worker *w, const Enum_Machine *em, uint64_t *steps_out, size_t *slot)
+{
+    const Enumerator *en = w->en;
+    bool runaway[ENUM_MAX_STATES];
+    enum_compute_runaway(en, em, runaway);
+
+    uint8_t *tape = w->tape;
+    size_t state = 0;
+    size_t head = 0;
+    size_t max_head = 0;
+    uint64_t steps = 0;
+    Enum_Result result = ER_HOLDOUT;
+
+    // Brent's cycle detection: the configuration is saved at every power of two steps. If the
+    // Machine comes back to the saved one without visiting any new cells it loops forever.
+    size_t saved_state = SIZE_MAX;
+    size_t saved_head = 0;
+    size_t saved_max_head = 0;
+    uint64_t next_save = 1;
+
+    // Translated cycles are detected the same way but on the records of the rightmost position.
+    // If the Machine sets a new record in the same state as the saved record, and the part of the
+    // tape it has looked at since then is the same as back then, only shifted, it will keep
+    // repeating itself going to the right forever.
+    size_t record_state = SIZE_MAX;
+    size_t record_head = 0;
+    size_t min_head_since_record = 0;
+    uint64_t records = 0;
+    uint64_t next_record_save = 1;
+
+    while (steps < en->steps_limit) {
+        if (state == saved_state && head == saved_head && max_head == saved_max_head
+            && memcmp(tape, w->saved_tape, max_head + 1) == 0) {
+            result = ER_NONHALTING;
+            break;
+        }
+        if (steps == next_save) {
+            saved_state = state;
+            saved_head = head;
+            saved_max_head = max_head;
+            memcpy(w->saved_tape, tape, max_head + 1);
+            next_save *= 2;
+        }
+
+        uint8_t read = tape[head];
+        Enum_Transition t = em->table[state*ENUM_MAX_SYMBOLS + read];
+        if (t.step == 0) {
+            *slot = state*ENUM_MAX_SYMBOLS + read;
+            result = ER_UNDEFINED;
+            break;
+        }
+        tape[head] = t.write;
+        state = t.next;
+        steps += 1;
+        if (t.step < 0 && head == 0) {
+            result = ER_HALT;
+            break;
+        }
+        head += t.step;
+        if (head < min_head_since_record) min_head_since_record = head;
+        if (head > max_head) {
+            max_head = head;
+            if (runaway[state]) {
+                result = ER_NONHALTING;
+                break;
+            }
+
+            if (state == record_state) {
+                size_t shift = head - record_head;
+                size_t count = record_head - min_head_since_record + 1;
+                if (memcmp(&tape[min_head_since_record + shift], &w->record_tape[min_head_since_record], count) == 0) {
+                    result = ER_NONHALTING;
+                    break;
+                }
+            }
+            records += 1;
+            if (records == next_record_save) {
+                record_state = state;
+                record_head = head;
+                min_head_since_record = head;
+                memcpy(w->record_tape, tape, head + 1);
+                next_record_save *= 2;
+            }
+        }
+    }
+
+    memset(tape, 0, max_head + 1);
+    *steps_out = steps;
+    return result;
+}
+
+// Records the outcome of the Machine. Returns true and the undefined transition it got stuck
+// on if the Machine should be branched on.
+static bool enum_visit(Enum_Worker *w, const Enum_Machine *em, size_t *slot)
+{
+    Enumerator *en = w->en;
+    w->enumerated += 1;
+
+    uint64_t steps;
+    Enum_Result result = enum_run(w, em, &steps, slot);
+    switch (result) {
+    case ER_HALT:
+    case ER_UNDEFINED: {
+        w->halting += 1;
+        uint_fast64_t champion = atomic_load(&en->champion);
+        while (steps >= champion) {
+            if (atomic_compare_exchange_weak(&en->champion, &champion, steps)) {
+                enum_report(w, em, "halt", steps);
+                break;
+            }
+        }
+        return result == ER_UNDEFINED;
+    }
+    case ER_NONHALTING: {
+        w->nonhalting += 1;
+        return false;
+    }
+    case ER_HOLDOUT: {
+        w->holdouts += 1;
+        enum_report(w, em, "holdout", steps);
+        return false;
+    }
+    default: UNREACHABLE("Unexpected Enum_Result");
+    }
+}
+
+// With every transition defined the only way to halt is to underflow the tape
+static bool enum_trivially_nonhalting(const Enumerator *en, const Enum_Machine *em)
+{
+    if (em->defined < en->states*en->symbols) return false;
+    for (size_t s = 0; s < en->states; ++s) {
+        for (size_t r = 0; r < en->symbols; ++r) {
+            if (em->table[s*ENUM_MAX_SYMBOLS + r].step < 0) return false;
+        }
+    }
+    return true;
+}
+
+// Only the symbols and the states that were already used plus one new of each can be picked,
+// which is what keeps the enumeration in the Tree Normal Form
+static size_t enum_children_count(const Enumerator *en, const Enum_Machine *em)
+{
+    size_t writes = em->symbols_used < en->symbols ? (size_t) em->symbols_used + 1 : en->symbols;
+    size_t nexts = em->states_used < en->states ? (size_t) em->states_used + 1 : en->states;
+    return writes*2*nexts;
+}
+
+// Defines the undefined transition `slot` in the k-th possible way. Returns false if the
+// resulting Machine is trivially non-halting and should not be enumerated any further.
+static bool enum_child(const Enumerator *en, const Enum_Machine *em, size_t slot, size_t k, Enum_Machine *child)
+{
+    size_t nexts = em->states_used < en->states ? (size_t) em->states_used + 1 : en->states;
+    size_t next = k%nexts;
+    int step = (k/nexts)%2 == 0 ? -1 : 1;
+    size_t write = k/nexts/2;
+
+    *child = *em;
+    child->table[slot] = (Enum_Transition) {
+        .write = write,
+        .next = next,
+        .step = step,
+    };
+    child->defined += 1;
+    if (write == child->symbols_used) child->symbols_used += 1;
+    if (next == child->states_used) child->states_used += 1;
+    return !enum_trivially_nonhalting(en, child);
+}
+
+static void enum_dfs(Enum_Worker *w, const Enum_Machine *em)
+{
+    size_t slot;
+    if (!enum_visit(w, em, &slot)) return;
+
+    size_t count = enum_children_count(w->en, em);
+    for (size_t k = 0; k < count; ++k) {
+        Enum_Machine child;
+        if (enum_child(w->en, em, slot, k, &child)) {
+            enum_dfs(w, &child);
+        } else {
+            w->enumerated += 1;
+            w->nonhalting += 1;
+        }
+    }
+}
+
+static void *enum_worker(void *arg)
+{
+    Enum_Worker *w = arg;
+    Enumerator *en = w->en;
+    size_t i;
+    while ((i = atomic_fetch_add(&en->next_task, 1)) < en->tasks.count) {
+        enum_dfs(w, &en->tasks.data[i]);
+    }
+    return NULL;
+}
+
+static void enumerate_usage(const char *program_name)
+{
+    printf("Usage: %s enumerate --states <n> --symbols <m> [OPTIONS]\n", program_name);
+    printf("OPTIONS:\n");
+    printf("    --steps <limit>     step budget of every Machine (default %d)\n", ENUM_DEFAULT_STEPS);
+    printf("    --threads <count>   amount of worker threads (default: amount of cores)\n");
+    printf("    --output <path>     where to stream the halting champions and the holdouts (default: stdout)\n");
+}
+
+int enumerate_main(const char *program_name, int argc, char **argv)
+{
+    Enumerator en = {
+        .steps_limit = ENUM_DEFAULT_STEPS,
+        .output = stdout,
+    };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads_count = cpus > 0 ? (size_t) cpus : 1;
+    const char *output_path = NULL;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (argc == 0) {
+            enumerate_usage(program_name);
+            printf("ERROR: no value was provided for %s\n", flag);
+            return 1;
+        }
+        const char *value = shift_args(&argc, &argv);
+        uint64_t count;
+        if (strcmp(flag, "--states") == 0) {
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            en.states = count;
+        } else if (strcmp(flag, "--symbols") == 0) {
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            en.symbols = count;
+        } else if (strcmp(flag, "--steps") == 0) {
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            // Every worker has three tapes of `steps + 2` cells
+            if (count > SIZE_MAX/4) {
+                printf("ERROR: %s may be at most %zu\n", flag, SIZE_MAX/4);
+                return 1;
+            }
+            en.steps_limit = count;
+        } else if (strcmp(flag, "--threads") == 0) {
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            if (count < 1 || count > ENUM_MAX_THREADS) {
+                printf("ERROR: %s must be within 1..%d\n", flag, ENUM_MAX_THREADS);
+                return 1;
+            }
+            threads_count = count;
+        } else if (strcmp(flag, "--output") == 0) {
+            output_path = value;
+        } else {
+            enumerate_usage(program_name);
+            printf("ERROR: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+
+    if (en.states < 1 || en.states > ENUM_MAX_STATES) {
+        enumerate_usage(program_name);
+        printf("ERROR: amount of states must be within 1..%d\n", ENUM_MAX_STATES);
+        return 1;
+    }
+    if (en.symbols < 1 || en.symbols > ENUM_MAX_SYMBOLS) {
+        enumerate_usage(program_name);
+        printf("ERROR: amount of symbols must be within 1..%d\n", ENUM_MAX_SYMBOLS);
+        return 1;
+    }
+
+    if (output_path != NULL) {
+        en.output = fopen(output_path, "w");
+        if (en.output == NULL) {
+            printf("ERROR: could not open file %s: %s\n", output_path, strerror(errno));
+            return 1;
+        }
+    }
+    pthread_mutex_init(&en.output_mutex, NULL);
+
+    // The head can't get further than the amount of steps
+    Enum_Worker *workers = calloc(threads_count, sizeof(*workers));
+    assert(workers != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < threads_count; ++i) {
+        workers[i].en = &en;
+        workers[i].tape = calloc(en.steps_limit + 2, sizeof(*workers[i].tape));
+        workers[i].saved_tape = calloc(en.steps_limit + 2, sizeof(*workers[i].saved_tape));
+        workers[i].record_tape = calloc(en.steps_limit + 2, sizeof(*workers[i].record_tape));
+        assert(workers[i].tape != NULL && "Buy more RAM lol");
+        assert(workers[i].saved_tape != NULL && "Buy more RAM lol");
+        assert(workers[i].record_tape != NULL && "Buy more RAM lol");
+    }
+
+    // Expand the top of the tree breadth-first on the main thread until there is enough
+    // independent subtrees to keep all the workers busy
+    Enum_Machine root = {
+        .states_used = 1,
+        .symbols_used = 1,
+    };
+    da_append(&en.tasks, root);
+    size_t begin = 0;
+    while (begin < en.tasks.count && en.tasks.count - begin < threads_count*ENUM_TASKS_PER_THREAD) {
+        Enum_Machine em = en.tasks.data[begin++];
+        size_t slot;
+        if (!enum_visit(&workers[0], &em, &slot)) continue;
+        size_t count = enum_children_count(&en, &em);
+        for (size_t k = 0; k < count; ++k) {
+            Enum_Machine child;
+            if (enum_child(&en, &em, slot, k, &child)) {
+                da_append(&en.tasks, child);
+            } else {
+                workers[0].enumerated += 1;
+                workers[0].nonhalting += 1;
+            }
+        }
+    }
+    atomic_init(&en.next_task, begin);
+
+    pthread_t *threads = calloc(threads_count, sizeof(*threads));
+    assert(threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < threads_count; ++i) {
+        pthread_create(&threads[i], NULL, enum_worker, &workers[i]);
+    }
+
+    Enum_Worker total = {0};
+    for (size_t i = 0; i < threads_count; ++i) {
+        pthread_join(threads[i], NULL);
+        total.enumerated += workers[i].enumerated;
+        total.halting    += workers[i].halting;
+        total.nonhalting += workers[i].nonhalting;
+        total.holdouts   += workers[i].holdouts;
+        free(workers[i].tape);
+        free(workers[i].saved_tape);
+        free(workers[i].record_tape);
+    }
+
+    if (output_path != NULL) fclose(en.output);
+    fflush(stdout);
+
+    fprintf(stderr, "Enumerated %"PRIu64" machines with %zu states and %zu symbols: %"PRIu64" halting, %"PRIu64" non-halting, %"PRIu64" holdouts\n",
+            total.enumerated, en.states, en.symbols, total.halting, total.nonhalting, total.holdouts);
+    fprintf(stderr, "Champion halts after %"PRIu64" steps\n", (uint64_t) atomic_load(&en.champion));
+
+    pthread_mutex_destroy(&en.output_mutex);
+    free(threads);
+    free(workers);
+    free(en.tasks.data);
+    return 0;
+}
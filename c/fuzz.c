@@ -0,0 +1,1023 @@
+// # Differential Fuzzing
+//
+// `turj fuzz` generates random programs and tapes and runs them through every execution engine
+// of turj under a step budget. Every engine must end up in exactly the same configuration as the
+// reference interpreter, which scans the rules linearly by their text the way the language is
+// defined: the first matching rule wins, the Machine halts if no rule matches and moving left
+// from the first cell underflows the tape. The first mismatch is minimized by throwing away the
+// rules, the tape segments and the steps that are not needed to reproduce it and printed as a
+// program ready to be debugged.
+
+#define FUZZ_DEFAULT_ITERATIONS 10000
+#define FUZZ_DEFAULT_STEPS 1000
+#define FUZZ_MAX_STATES 6
+#define FUZZ_MAX_SYMBOLS 4
+#define FUZZ_MAX_SEGMENTS 4
+#define FUZZ_UNDO_CAPACITY (1<<20)
+// The lines of the trace take as much as the whole tape, so only the beginning of the longer runs
+// is traced
+#define FUZZ_TRACE_STEPS 1000
+
+// One more state than the rules may start from, so some Machines halt by reaching it
+static const char *FUZZ_STATES[FUZZ_MAX_STATES + 1] = {"A", "B", "C", "D", "E", "F", "H"};
+static const char *FUZZ_SYMBOLS[FUZZ_MAX_SYMBOLS] = {"0", "1", "2", "3"};
+
+typedef struct {
+    String_View *data;
+    size_t count;
+    size_t capacity;
+} Fuzz_Tape;
+
+// The final configuration in terms of the symbol texts, so the engines with different ids agree
+typedef struct {
+    Exec_Status status;
+    uint64_t steps;
+    String_View state;
+    size_t head;
+    Fuzz_Tape tape;
+} Fuzz_Outcome;
+
+typedef struct {
+    Top_Level *tl;
+    const Machine *m;
+    uint64_t limit;
+    // Seeds the choices the engines make on their own, like the layout of the renumbered table
+    uint64_t seed;
+    uint64_t rng;
+    // Scratch directory for the cache and the spilled tapes
+    const char *dir;
+} Fuzz;
+
+// Returns NULL if the engine is consistent with itself, otherwise what is broken
+typedef const char *(*Fuzz_Engine_Run)(Fuzz *f, Fuzz_Outcome *out);
+
+typedef struct {
+    const char *name;
+    Fuzz_Engine_Run run;
+    // Checks only every n-th program, chosen by the seed so the minimization keeps checking it
+    uint64_t every;
+} Fuzz_Engine;
+
+static uint64_t fuzz_random(Fuzz *f)
+{
+    f->rng += 0x9e3779b97f4a7c15ULL;
+    return mix64(f->rng);
+}
+
+static size_t fuzz_below(Fuzz *f, size_t n)
+{
+    return fuzz_random(f)%n;
+}
+
+static Token fuzz_token(const char *text, Token_Kind kind)
+{
+    return (Token) {
+        .kind = kind,
+        .loc = { .file_path = SV("fuzz"), .row = 1, .col = 1 },
+        .text = sv_from_cstr(text),
+    };
+}
+
+static Rule fuzz_rule(Fuzz *f, size_t states_count, size_t symbols_count)
+{
+    return (Rule) {
+        .state = fuzz_token(FUZZ_STATES[fuzz_below(f, states_count)], TK_SYMBOL),
+        .read = fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL),
+        .write = fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL),
+        .step = fuzz_token(fuzz_below(f, 2) ? "->" : "<-", TK_ARROW),
+        .next = fuzz_token(FUZZ_STATES[fuzz_below(f, states_count + 1)], TK_SYMBOL),
+    };
+}
+
+static void fuzz_generate(Fuzz *f, Top_Level *tl)
+{
+    size_t states_count = 1 + fuzz_below(f, FUZZ_MAX_STATES);
+    size_t symbols_count = 1 + fuzz_below(f, FUZZ_MAX_SYMBOLS);
+
+    // Twice as many rules as there are slots on average, so plenty of them are duplicates
+    size_t rules_count = fuzz_below(f, 4*states_count*symbols_count + 1);
+    for (size_t i = 0; i < rules_count; ++i) da_append(&tl->rules, fuzz_rule(f, states_count, symbols_count));
+
+    if (fuzz_below(f, 4) == 0) {
+        // Instantiated exactly like `State x x -> Next for x : Set | {...}` and the like
+        Set set = { .name = fuzz_token("Set", TK_SYMBOL) };
+        da_append(&set.expr, ((Set_Op) { SET_OP_EMPTY, fuzz_token("{", TK_OCURLY) }));
+        size_t items_count = 1 + fuzz_below(f, symbols_count);
+        for (size_t i = 0; i < items_count; ++i) {
+            da_append(&set.expr, ((Set_Op) { SET_OP_INSERT, fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL) }));
+        }
+        da_append(&tl->sets, set);
+
+        Set_Expr expr = {0};
+        da_append(&expr, ((Set_Op) { SET_OP_NAME, set.name }));
+        size_t ops_count = fuzz_below(f, 3);
+        for (size_t i = 0; i < ops_count; ++i) {
+            da_append(&expr, ((Set_Op) { SET_OP_EMPTY, fuzz_token("{", TK_OCURLY) }));
+            da_append(&expr, ((Set_Op) { SET_OP_INSERT, fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL) }));
+            Set_Op_Kind kinds[] = { SET_OP_UNION, SET_OP_DIFFERENCE, SET_OP_INTERSECTION };
+            da_append(&expr, ((Set_Op) { kinds[fuzz_below(f, 3)], fuzz_token("|", TK_PIPE) }));
+        }
+
+        Token x = fuzz_token("x", TK_SYMBOL);
+        Rule rule = fuzz_rule(f, states_count, symbols_count);
+        rule.read = x;
+        if (fuzz_below(f, 2)) rule.write = x;
+        bool expanded = expand_for(tl, rule, x, &expr, tl->sets.count);
+        assert(expanded);
+        free(expr.data);
+    }
+
+    Run run = {
+        .state = fuzz_token(FUZZ_STATES[fuzz_below(f, states_count)], TK_SYMBOL),
+        .loc = { .file_path = SV("fuzz"), .row = 1, .col = 1 },
+    };
+    size_t segments_count = 1 + fuzz_below(f, FUZZ_MAX_SEGMENTS);
+    for (size_t i = 0; i < segments_count; ++i) {
+        if (fuzz_below(f, 4) == 0) {
+            size_t group = 1 + fuzz_below(f, 2);
+            da_append(&run.tape, ((Tape_Segment) {
+                .symbol = fuzz_token("[", TK_OBRACKET),
+                .count = 1 + fuzz_below(f, 3),
+                .group = group,
+            }));
+            for (size_t j = 0; j < group; ++j) {
+                da_append(&run.tape, ((Tape_Segment) {
+                    .symbol = fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL),
+                    .count = 1 + fuzz_below(f, 3),
+                }));
+            }
+        } else {
+            da_append(&run.tape, ((Tape_Segment) {
+                .symbol = fuzz_token(FUZZ_SYMBOLS[fuzz_below(f, symbols_count)], TK_SYMBOL),
+                .count = 1 + fuzz_below(f, 3),
+            }));
+        }
+    }
+    // The members of a group are never groups, so the last segment is always a symbol
+    run.init = run.tape.data[run.tape.count - 1].symbol;
+    da_append(&tl->runs, run);
+}
+
+static size_t fuzz_expand_segments(const Tape_Segment *segments, Fuzz_Tape *tape)
+{
+    const Tape_Segment *it = &segments[0];
+    for (size_t i = 0; i < it->count; ++i) {
+        if (it->group == 0) {
+            da_append(tape, it->symbol.text);
+        } else {
+            for (size_t j = 1; j <= it->group;) j += fuzz_expand_segments(&segments[j], tape);
+        }
+    }
+    return 1 + it->group;
+}
+
+// The semantics of `#run` straight from the rules, without any of the compiled machinery. With
+// the `accept` state it stops with EXEC_BREAK as soon as it gets there, like `#nrun` does.
+static void fuzz_reference_(const Top_Level *tl, uint64_t limit, const String_View *accept, Fuzz_Outcome *out)
+{
+    const Run *run = &tl->runs.data[0];
+    out->tape.count = 0;
+    for (size_t i = 0; i < run->tape.count;) i += fuzz_expand_segments(&run->tape.data[i], &out->tape);
+
+    String_View state = run->state.text;
+    size_t head = 0;
+    uint64_t steps = 0;
+    Exec_Status status = EXEC_LIMIT;
+    if (accept != NULL && sv_eq(state, *accept)) status = EXEC_BREAK;
+    while (status == EXEC_LIMIT && steps < limit) {
+        while (head >= out->tape.count) da_append(&out->tape, run->init.text);
+
+        const Rule *rule = NULL;
+        for (size_t i = 0; i < tl->rules.count && rule == NULL; ++i) {
+            const Rule *it = &tl->rules.data[i];
+            if (sv_eq(it->state.text, state) && sv_eq(it->read.text, out->tape.data[head])) rule = it;
+        }
+        if (rule == NULL) {
+            status = EXEC_HALT;
+            break;
+        }
+
+        out->tape.data[head] = rule->write.text;
+        state = rule->next.text;
+        steps += 1;
+        if (sv_eq(rule->step.text, SV("<-"))) {
+            if (head == 0) status = EXEC_UNDERFLOW; else head -= 1;
+        } else {
+            head += 1;
+        }
+        // Even the step that falls off the tape reaches its next state
+        if (accept != NULL && sv_eq(state, *accept)) status = EXEC_BREAK;
+    }
+
+    out->status = status;
+    out->steps = steps;
+    out->state = state;
+    out->head = head;
+}
+
+static void fuzz_reference(const Top_Level *tl, uint64_t limit, Fuzz_Outcome *out)
+{
+    fuzz_reference_(tl, limit, NULL, out);
+}
+
+static void fuzz_outcome_from_exec(const Exec *e, Exec_Status status, Fuzz_Outcome *out)
+{
+    out->status = status;
+    out->steps = e->steps;
+    out->state = e->m->states.data[e->state];
+    out->head = e->head;
+    out->tape.count = 0;
+    for (size_t i = 0; i < exec_tape_count(e); ++i) da_append(&out->tape, e->m->alphabet.data[exec_cell(e, i)]);
+}
+
+// The tapes are infinite, so the cells that were never materialized hold the `init` symbol
+static bool fuzz_outcome_eq(const Fuzz_Outcome *a, const Fuzz_Outcome *b, String_View init)
+{
+    if (a->status != b->status || a->steps != b->steps || a->head != b->head) return false;
+    if (!sv_eq(a->state, b->state)) return false;
+    size_t count = a->tape.count > b->tape.count ? a->tape.count : b->tape.count;
+    for (size_t i = 0; i < count; ++i) {
+        String_View x = i < a->tape.count ? a->tape.data[i] : init;
+        String_View y = i < b->tape.count ? b->tape.data[i] : init;
+        if (!sv_eq(x, y)) return false;
+    }
+    return true;
+}
+
+static size_t fuzz_append_segments(String_Builder *sb, const Tape_Segment *segments)
+{
+    const Tape_Segment *it = &segments[0];
+    if (it->group > 0) {
+        sb_append_cstr(sb, "[");
+        for (size_t j = 1; j <= it->group;) {
+            if (j > 1) sb_append_cstr(sb, " ");
+            j += fuzz_append_segments(sb, &segments[j]);
+        }
+        sb_append_cstr(sb, "]");
+    } else {
+        sb_append_symbol(sb, it->symbol.text);
+    }
+    if (it->count > 1) {
+        char count[32];
+        snprintf(count, sizeof(count), "*%zu", it->count);
+        sb_append_cstr(sb, count);
+    }
+    return 1 + it->group;
+}
+
+// Prints the rules and the run back as the text of the program. With `split` some of the rules
+// are broken across the lines at random.
+static void fuzz_render_program(const Top_Level *tl, Fuzz *split, String_Builder *sb)
+{
+    for (size_t i = 0; i < tl->rules.count; ++i) {
+        const Rule *it = &tl->rules.data[i];
+        String_View tokens[] = { it->state.text, it->read.text, it->write.text, it->step.text, it->next.text };
+        for (size_t j = 0; j < 5; ++j) {
+            if (j > 0) sb_append_cstr(sb, split != NULL && fuzz_below(split, 4) == 0 ? "\n" : " ");
+            if (j == 3) sb_append_buf(sb, tokens[j].data, tokens[j].count); else sb_append_symbol(sb, tokens[j]);
+        }
+        sb_append_cstr(sb, "\n");
+    }
+    const Run *run = &tl->runs.data[0];
+    sb_append_cstr(sb, "#run ");
+    sb_append_symbol(sb, run->state.text);
+    sb_append_cstr(sb, " [");
+    for (size_t i = 0; i < run->tape.count;) {
+        if (i > 0) sb_append_cstr(sb, " ");
+        i += fuzz_append_segments(sb, &run->tape.data[i]);
+    }
+    sb_append_cstr(sb, "]\n");
+}
+
+static const char *fuzz_exec_step(Fuzz *f, Fuzz_Outcome *out)
+{
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    Exec_Status status = EXEC_LIMIT;
+    while (e.steps < f->limit) {
+        status = exec_step(&e);
+        if (status != EXEC_OK) break;
+        status = EXEC_LIMIT;
+    }
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    return NULL;
+}
+
+static const char *fuzz_exec_run(Fuzz *f, Fuzz_Outcome *out)
+{
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    return NULL;
+}
+
+// exec_run() on the cells of the given width instead of the narrowest one
+static const char *fuzz_exec_run_width(Fuzz *f, Fuzz_Outcome *out, unsigned bits)
+{
+    Machine m = {0};
+    if (!machine_compile(&m, f->tl)) return "the program does not compile again";
+    machine_compile_narrow(&m, bits);
+
+    Exec e;
+    exec_from_run(&m, &f->tl->runs.data[0], NULL, &e);
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    machine_free(&m);
+    return NULL;
+}
+
+static const char *fuzz_exec_run16(Fuzz *f, Fuzz_Outcome *out)
+{
+    return fuzz_exec_run_width(f, out, 16);
+}
+
+static const char *fuzz_exec_run32(Fuzz *f, Fuzz_Outcome *out)
+{
+    return fuzz_exec_run_width(f, out, 32);
+}
+
+// The hash table the programs with way more (state, symbol) pairs than rules are compiled into
+static const char *fuzz_exec_sparse(Fuzz *f, Fuzz_Outcome *out)
+{
+    Machine m = {0};
+    if (!machine_compile_(&m, f->tl, true)) return "the program does not compile again";
+
+    Exec e;
+    exec_from_run(&m, &f->tl->runs.data[0], NULL, &e);
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    machine_free(&m);
+    return NULL;
+}
+
+// The generic path of exec_run_() taken by --profile-out and --tape-stats
+static const char *fuzz_exec_run_profiled(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    Tape_Stats stats = {0};
+    e.counts = calloc(f->m->slots_count, sizeof(*e.counts));
+    assert(e.counts != NULL && "Buy more RAM lol");
+    e.stats = &stats;
+
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+
+    uint64_t counted = 0;
+    for (size_t i = 0; i < f->m->slots_count; ++i) counted += e.counts[i];
+    uint64_t visited = 0;
+    for (size_t i = 0; i < TAPE_STATS_BUCKETS; ++i) visited += stats.visits[i];
+    if (counted != e.steps) broken = "the profile does not count every step exactly once";
+    if (visited != e.steps) broken = "the head histogram does not count every step exactly once";
+
+    free(e.counts);
+    free(stats.growth.data);
+    exec_free(&e);
+    return broken;
+}
+
+// Records the run into the Undo_Log of the debugger and reverts it all the way back
+static const char *fuzz_exec_undo(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    exec_widen(&e);
+    Symbol_Id state = e.state;
+    Cells tape = {0};
+    da_append_many(&tape, e.tape.data, e.tape.count);
+
+    Undo_Log undo = { .capacity = 1 };
+    while (undo.capacity < f->limit && undo.capacity < FUZZ_UNDO_CAPACITY) undo.capacity *= 2;
+    undo.data = malloc(undo.capacity*sizeof(*undo.data));
+    assert(undo.data != NULL && "Buy more RAM lol");
+    e.undo = &undo;
+
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+
+    // The log forgets the oldest steps of the longer runs
+    if (undo.count == e.steps) {
+        while (exec_undo(&e)) {}
+        if (e.steps != 0 || e.head != 0 || e.state != state) broken = "undoing every step does not return to the initial configuration";
+        for (size_t i = 0; i < e.tape.count && broken == NULL; ++i) {
+            if (e.tape.data[i] != (i < tape.count ? tape.data[i] : e.init)) broken = "undoing every step does not restore the initial tape";
+        }
+    }
+
+    free(undo.data);
+    free(tape.data);
+    exec_free(&e);
+    return broken;
+}
+
+// The table laid out in an arbitrary order like --profile-in does it
+static const char *fuzz_exec_renumbered(Fuzz *f, Fuzz_Outcome *out)
+{
+    Machine m = {0};
+    if (!machine_compile(&m, f->tl)) return "the program does not compile again";
+    Profile_Rank *states = calloc(m.states.count, sizeof(*states));
+    Profile_Rank *symbols = calloc(m.alphabet.count, sizeof(*symbols));
+    assert(states != NULL && symbols != NULL && "Buy more RAM lol");
+    for (Symbol_Id id = 0; id < m.states.count; ++id) states[id] = (Profile_Rank) { id, mix64(f->seed ^ id)%4 };
+    for (Symbol_Id id = 0; id < m.alphabet.count; ++id) symbols[id] = (Profile_Rank) { id, mix64(~f->seed ^ id)%4 };
+    machine_renumber(&m, states, symbols);
+    free(states);
+    free(symbols);
+
+    Exec e;
+    exec_from_run(&m, &f->tl->runs.data[0], NULL, &e);
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    machine_free(&m);
+    return NULL;
+}
+
+// Stores the result into the --cache and loads it back into a fresh run
+static const char *fuzz_exec_cache(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Cache cache = {0};
+    cache_init(&cache, f->dir, f->m);
+
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    Cache_Key key = cache_key(&cache, &e);
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    cache_store(&cache, key, &e, status);
+    exec_free(&e);
+
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    if (cache_load(&cache, key, &e, &status)) {
+        fuzz_outcome_from_exec(&e, status, out);
+    } else {
+        broken = "the stored result can not be loaded back";
+    }
+    exec_free(&e);
+
+    String_Builder path = {0};
+    cache_path(&cache, key, &path);
+    remove(path.data);
+    free(path.data);
+    cache_free(&cache);
+    return broken;
+}
+
+static const char *fuzz_exec_spilled(Fuzz *f, Fuzz_Outcome *out)
+{
+    String_Builder path = {0};
+    sb_append_cstr(&path, f->dir);
+    sb_append_cstr(&path, "/tape");
+    sb_append_null(&path);
+
+    Exec e;
+    Tape_Spill spill = { .path = path.data };
+    bool opened = exec_from_run(f->m, &f->tl->runs.data[0], &spill, &e);
+    free(path.data);
+    if (!opened) return "the tape can not be spilled";
+    Exec_Status status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+    exec_free(&e);
+    return NULL;
+}
+
+// The trace the writer thread of trace_run() renders into a file. It must have the lines of every
+// configuration and end with the one the Machine stopped in.
+static const char *fuzz_exec_trace(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Fuzz choices = { .rng = f->seed };
+    Trace_Format fmt = {
+        .rle = fuzz_below(&choices, 2),
+        .windowed = fuzz_below(&choices, 2),
+        .window = fuzz_below(&choices, 4),
+    };
+
+    String_Builder path = {0};
+    sb_append_cstr(&path, f->dir);
+    sb_append_cstr(&path, "/trace");
+    sb_append_null(&path);
+    int fd = open(path.data, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        free(path.data);
+        return "the trace can not be written";
+    }
+
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    exec_ensure_head(&e);
+    Exec_Status status = trace_run(&e, f->limit < FUZZ_TRACE_STEPS ? f->limit : FUZZ_TRACE_STEPS, fd, &fmt);
+    close(fd);
+    // The step that falls off the tape is not traced
+    uint64_t traced = status == EXEC_UNDERFLOW ? e.steps - 1 : e.steps;
+    if (status == EXEC_LIMIT) status = exec_run(&e, f->limit, NULL);
+    fuzz_outcome_from_exec(&e, status, out);
+
+    String_Builder trace = {0};
+    if (read_entire_file(path.data, &trace) != 0) broken = "the trace can not be read back";
+    remove(path.data);
+    free(path.data);
+
+    Fuzz_Outcome last = {0};
+    fuzz_reference(f->tl, traced, &last);
+    Cells tape = {0};
+    for (size_t i = 0; i < last.tape.count || i <= last.head; ++i) {
+        Symbol_Id symbol = e.init;
+        if (i < last.tape.count) symbols_find(&f->m->alphabet, last.tape.data[i], &symbol);
+        da_append(&tape, symbol);
+    }
+    Symbol_Id state;
+    symbols_find(&f->m->states, last.state, &state);
+    String_Builder line = {0};
+    trace_render_line(&line, f->m, &tape, e.init, state, last.head, &fmt);
+
+    // Every configuration takes the line of the tape and the line of the carets
+    size_t lines = 0;
+    for (size_t i = 0; i < trace.count; ++i) lines += trace.data[i] == '\n';
+    if (broken == NULL && lines != 2*(traced + 1)) broken = "the trace does not have the lines of every step";
+    if (broken == NULL && (trace.count < line.count || memcmp(trace.data + trace.count - line.count, line.data, line.count) != 0)) {
+        broken = "the trace does not end with the final configuration";
+    }
+
+    free(line.data);
+    free(tape.data);
+    free(last.tape.data);
+    free(trace.data);
+    exec_free(&e);
+    return broken;
+}
+
+// Records the run with the tiny Undo_Log and snapshots of the debugger and seeks back and forth to
+// random steps, so every seek replays from one snapshot or another
+static const char *fuzz_exec_history(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Fuzz choices = { .rng = f->seed };
+    Exec e;
+    exec_from_run(f->m, &f->tl->runs.data[0], NULL, &e);
+    History h = {0};
+    history_init_(&h, &e, (size_t) 1<<fuzz_below(&choices, 5), 1 + fuzz_below(&choices, 16), fuzz_below(&choices, 4096));
+    Exec_Status status = history_run(&h, &e, f->limit, NULL);
+    uint64_t total = e.steps;
+
+    Fuzz_Outcome expected = {0};
+    Fuzz_Outcome actual = {0};
+    String_View init = f->tl->runs.data[0].init.text;
+    for (size_t i = 0; i < 8 && broken == NULL; ++i) {
+        uint64_t target = fuzz_below(&choices, total + 1);
+        history_seek(&h, &e, target);
+        fuzz_reference(f->tl, target, &expected);
+        fuzz_outcome_from_exec(&e, expected.status, &actual);
+        if (!fuzz_outcome_eq(&expected, &actual, init)) broken = "seeking to a step does not reproduce its configuration";
+    }
+    history_seek(&h, &e, total);
+    fuzz_outcome_from_exec(&e, status, out);
+
+    free(expected.tape.data);
+    free(actual.tape.data);
+    history_free(&h, &e);
+    exec_free(&e);
+    return broken;
+}
+
+// `#nrun` of the program with just the first rule of every (State, Read) pair, so there is a single
+// path to search. It must reach the accepting state exactly where the reference interpreter does.
+static const char *fuzz_exec_nrun(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Fuzz choices = { .rng = f->seed };
+    // The search ends up in no particular configuration, so it only tells what is broken
+    fuzz_reference(f->tl, f->limit, out);
+
+    Machine m = {0};
+    if (!machine_compile(&m, f->tl)) return "the program does not compile again";
+    Top_Level deterministic = {0};
+    bool *taken = calloc(m.slots_count, sizeof(*taken));
+    assert(taken != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < f->tl->rules.count; ++i) {
+        size_t slot = machine_rule_slot(&m, &f->tl->rules.data[i]);
+        if (taken[slot]) continue;
+        taken[slot] = true;
+        da_append(&deterministic.rules, f->tl->rules.data[i]);
+    }
+    free(taken);
+    machine_compile_alternatives(&m, &deterministic);
+
+    // Half of the time the state the Machine ends up in, so it is reached more often than not
+    String_View accept = fuzz_below(&choices, 2) ? out->state : m.states.data[fuzz_below(&choices, m.states.count)];
+    Run run = f->tl->runs.data[0];
+    run.nondeterministic = true;
+    run.accept = (Token) { .kind = TK_SYMBOL, .loc = run.loc, .text = accept };
+    Nrun n;
+    nrun_search(&n, &m, &run, f->limit);
+    const Config *found = atomic_load(&n.found);
+
+    Fuzz_Outcome expected = {0};
+    Fuzz_Outcome actual = {0};
+    fuzz_reference_(f->tl, f->limit, &accept, &expected);
+    if (found == NULL) {
+        if (expected.status == EXEC_BREAK) broken = "#nrun does not reach the accepting state";
+    } else if (expected.status != EXEC_BREAK) {
+        broken = "#nrun reaches the accepting state the Machine never gets to";
+    } else {
+        // Only the path leads to the configuration that was found, its tape is long gone
+        Configs path = {0};
+        for (const Config *it = found; it->parent != NULL; it = it->parent) da_append(&path, (Config*) it);
+        Cells tape = {0};
+        run_initial_tape(&m, &run, &tape);
+        for (size_t i = path.count; i-- > 0;) {
+            size_t head = path.data[i]->parent->head;
+            while (head >= tape.count) da_append(&tape, n.init);
+            tape.data[head] = path.data[i]->via.write;
+        }
+
+        actual = (Fuzz_Outcome) {
+            .status = EXEC_BREAK,
+            .steps = path.count,
+            .state = m.states.data[found->state],
+            .head = found->head,
+        };
+        for (size_t i = 0; i < tape.count; ++i) da_append(&actual.tape, m.alphabet.data[tape.data[i]]);
+        if (!fuzz_outcome_eq(&expected, &actual, run.init.text)) broken = "#nrun reaches the accepting state somewhere else";
+        free(tape.data);
+        free(path.data);
+    }
+
+    free(expected.tape.data);
+    free(actual.tape.data);
+    nrun_free(&n);
+    free(deterministic.rules.data);
+    machine_free(&m);
+    return broken;
+}
+
+// Points the texts of the outcome into the Machine of the fuzzed program, so they outlive the
+// source they were parsed from
+static bool fuzz_outcome_rebase(Fuzz_Outcome *out, const Machine *m)
+{
+    Symbol_Id id;
+    if (!symbols_find(&m->states, out->state, &id)) return false;
+    out->state = m->states.data[id];
+    for (size_t i = 0; i < out->tape.count; ++i) {
+        if (!symbols_find(&m->alphabet, out->tape.data[i], &id)) return false;
+        out->tape.data[i] = m->alphabet.data[id];
+    }
+    return true;
+}
+
+// Parses the program printed back into its text split into a few chunks, however small, so they
+// begin in the middle of the rules as often as not
+static const char *fuzz_parse_chunked(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = NULL;
+    Fuzz choices = { .rng = f->seed };
+    String_Builder source = {0};
+    fuzz_render_program(f->tl, &choices, &source);
+
+    Top_Level tl = {0};
+    Machine m = {0};
+    if (!parse_program_chunked(&tl, sb_to_sv(source), SV("fuzz"), 2 + fuzz_below(&choices, 6))) {
+        broken = "the printed program does not parse back";
+    } else if (tl.rules.count != f->tl->rules.count || tl.runs.count != 1) {
+        broken = "the printed program parses back into different items";
+    } else if (!machine_compile(&m, &tl)) {
+        broken = "the parsed program does not compile";
+    } else {
+        Exec e;
+        exec_from_run(&m, &tl.runs.data[0], NULL, &e);
+        Exec_Status status = exec_run(&e, f->limit, NULL);
+        fuzz_outcome_from_exec(&e, status, out);
+        exec_free(&e);
+        if (!fuzz_outcome_rebase(out, f->m)) broken = "the parsed program has symbols the printed one does not";
+    }
+
+    machine_free(&m);
+    top_level_free(&tl);
+    free(source.data);
+    return broken;
+}
+
+// Maps the `zero` id to 0 and the other way around
+static uint8_t fuzz_enum_id(Symbol_Id id, Symbol_Id zero)
+{
+    if (id == zero) return 0;
+    if (id == 0) return zero;
+    return id;
+}
+
+// enum_run() of `turj enumerate`, its own interpreter with its own cycle detection, on the first
+// rule of every (State, Read) pair of the program. It always starts on the blank tape, so its
+// verdict is compared with exec_run() on the blank tape of the `init` symbol.
+static const char *fuzz_enum_run(Fuzz *f, Fuzz_Outcome *out)
+{
+    const char *broken = fuzz_exec_run(f, out);
+    const Machine *m = f->m;
+    const Run *run = &f->tl->runs.data[0];
+    if (m->states.count > ENUM_MAX_STATES || m->alphabet.count > ENUM_MAX_SYMBOLS) return broken;
+
+    // The blank symbol and the entry state of enum_run() are both 0
+    Symbol_Id init, entry;
+    symbols_find(&m->alphabet, run->init.text, &init);
+    symbols_find(&m->states, run->state.text, &entry);
+    Enum_Machine em = {0};
+    for (size_t i = 0; i < f->tl->rules.count; ++i) {
+        const Rule *it = &f->tl->rules.data[i];
+        Symbol_Id state, read, write, next;
+        symbols_find(&m->states, it->state.text, &state);
+        symbols_find(&m->alphabet, it->read.text, &read);
+        symbols_find(&m->alphabet, it->write.text, &write);
+        symbols_find(&m->states, it->next.text, &next);
+        Enum_Transition *t = &em.table[fuzz_enum_id(state, entry)*ENUM_MAX_SYMBOLS + fuzz_enum_id(read, init)];
+        if (t->step != 0) continue;
+        *t = (Enum_Transition) {
+            .write = fuzz_enum_id(write, init),
+            .next = fuzz_enum_id(next, entry),
+            .step = sv_eq(it->step.text, SV("<-")) ? -1 : 1,
+        };
+    }
+
+    Enumerator en = {
+        .states = m->states.count,
+        .symbols = m->alphabet.count,
+        .steps_limit = f->limit < ENUM_DEFAULT_STEPS ? f->limit : ENUM_DEFAULT_STEPS,
+    };
+    Enum_Worker w = {
+        .en = &en,
+        .tape = calloc(en.steps_limit + 2, sizeof(*w.tape)),
+        .saved_tape = calloc(en.steps_limit + 2, sizeof(*w.saved_tape)),
+        .record_tape = calloc(en.steps_limit + 2, sizeof(*w.record_tape)),
+    };
+    assert(w.tape != NULL && w.saved_tape != NULL && w.record_tape != NULL && "Buy more RAM lol");
+    uint64_t steps;
+    size_t slot;
+    Enum_Result result = enum_run(&w, &em, &steps, &slot);
+
+    Tape_Segment blank = { .symbol = run->init, .count = 1 };
+    Run blank_run = *run;
+    blank_run.tape = (Tape_Segments) { .data = &blank, .count = 1, .capacity = 1 };
+    Exec e;
+    exec_from_run(m, &blank_run, NULL, &e);
+    Exec_Status status = exec_run(&e, en.steps_limit, NULL);
+
+    switch (result) {
+    case ER_HALT:
+        if (status != EXEC_UNDERFLOW || steps != e.steps) broken = "enum_run does not underflow the tape where exec_run does";
+        break;
+    case ER_UNDEFINED:
+        if (status != EXEC_HALT || steps != e.steps) broken = "enum_run does not halt where exec_run does";
+        break;
+    case ER_NONHALTING:
+        if (status != EXEC_LIMIT) broken = "enum_run proves a Machine that halts non-halting";
+        break;
+    case ER_HOLDOUT:
+        if (status != EXEC_LIMIT || steps != en.steps_limit) broken = "enum_run gives up on a Machine that halts";
+        break;
+    default: UNREACHABLE("Unexpected Enum_Result");
+    }
+
+    exec_free(&e);
+    free(w.tape);
+    free(w.saved_tape);
+    free(w.record_tape);
+    return broken;
+}
+
+static Fuzz_Engine FUZZ_ENGINES[] = {
+    {"exec_step", fuzz_exec_step, 1},
+    {"exec_run", fuzz_exec_run, 1},
+    {"exec_run with 16 bit cells", fuzz_exec_run16, 1},
+    {"exec_run with 32 bit cells", fuzz_exec_run32, 1},
+    {"exec_run on the sparse table", fuzz_exec_sparse, 1},
+    {"exec_run --profile-out --tape-stats", fuzz_exec_run_profiled, 1},
+    {"exec_run with undo", fuzz_exec_undo, 1},
+    {"exec_run --profile-in", fuzz_exec_renumbered, 1},
+    {"exec_run --cache", fuzz_exec_cache, 1},
+    // Mapping a fresh spill file costs about a millisecond
+    {"exec_run --tape-spill", fuzz_exec_spilled, 32},
+    {"trace_run", fuzz_exec_trace, 8},
+    {"history_seek", fuzz_exec_history, 4},
+    // Every search clears the table of the visited configurations of the real size
+    {"#nrun", fuzz_exec_nrun, 16},
+    {"parse_program in chunks", fuzz_parse_chunked, 4},
+    {"enum_run", fuzz_enum_run, 1},
+};
+#define FUZZ_ENGINES_COUNT (sizeof(FUZZ_ENGINES)/sizeof(FUZZ_ENGINES[0]))
+
+typedef struct {
+    const Fuzz_Engine *engine;
+    const char *broken;
+    Fuzz_Outcome expected;
+    Fuzz_Outcome actual;
+} Fuzz_Mismatch;
+
+// Runs the program through the reference interpreter and every engine until the first one that
+// disagrees
+static bool fuzz_check(Fuzz *f, Fuzz_Mismatch *mismatch)
+{
+    Machine m = {0};
+    bool compiled = machine_compile(&m, f->tl);
+    assert(compiled);
+    f->m = &m;
+
+    fuzz_reference(f->tl, f->limit, &mismatch->expected);
+    mismatch->engine = NULL;
+    for (size_t i = 0; i < FUZZ_ENGINES_COUNT && mismatch->engine == NULL; ++i) {
+        if (f->seed%FUZZ_ENGINES[i].every != 0) continue;
+        mismatch->broken = FUZZ_ENGINES[i].run(f, &mismatch->actual);
+        if (mismatch->broken != NULL || !fuzz_outcome_eq(&mismatch->expected, &mismatch->actual, f->tl->runs.data[0].init.text)) {
+            mismatch->engine = &FUZZ_ENGINES[i];
+        }
+    }
+
+    f->m = NULL;
+    machine_free(&m);
+    return mismatch->engine != NULL;
+}
+
+// Greedily drops whatever the mismatch still reproduces without
+static void fuzz_minimize(Fuzz *f, Fuzz_Mismatch *mismatch)
+{
+    Top_Level *tl = f->tl;
+    Run *run = &tl->runs.data[0];
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        while (f->limit > 0) {
+            uint64_t limit = f->limit;
+            f->limit = limit/2;
+            if (!fuzz_check(f, mismatch)) {
+                f->limit = limit;
+                break;
+            }
+            progress = true;
+        }
+
+        for (size_t i = 0; i < tl->rules.count;) {
+            Rule rule = tl->rules.data[i];
+            memmove(&tl->rules.data[i], &tl->rules.data[i + 1], (tl->rules.count - i - 1)*sizeof(rule));
+            tl->rules.count -= 1;
+            if (fuzz_check(f, mismatch)) {
+                progress = true;
+                continue;
+            }
+            memmove(&tl->rules.data[i + 1], &tl->rules.data[i], (tl->rules.count - i)*sizeof(rule));
+            tl->rules.data[i] = rule;
+            tl->rules.count += 1;
+            i += 1;
+        }
+
+        for (size_t i = 0; i < run->tape.count;) {
+            Tape_Segment removed[3];
+            size_t count = 1 + run->tape.data[i].group;
+            assert(count <= 3);
+            if (count < run->tape.count) {
+                memcpy(removed, &run->tape.data[i], count*sizeof(*removed));
+                memmove(&run->tape.data[i], &run->tape.data[i + count], (run->tape.count - i - count)*sizeof(*removed));
+                run->tape.count -= count;
+                Token init = run->init;
+                run->init = run->tape.data[run->tape.count - 1].symbol;
+                if (fuzz_check(f, mismatch)) {
+                    progress = true;
+                    continue;
+                }
+                run->init = init;
+                memmove(&run->tape.data[i + count], &run->tape.data[i], (run->tape.count - i)*sizeof(*removed));
+                memcpy(&run->tape.data[i], removed, count*sizeof(*removed));
+                run->tape.count += count;
+            }
+            i += count;
+        }
+
+        for (size_t i = 0; i < run->tape.count; ++i) {
+            size_t count = run->tape.data[i].count;
+            if (count == 1) continue;
+            run->tape.data[i].count = 1;
+            if (fuzz_check(f, mismatch)) {
+                progress = true;
+            } else {
+                run->tape.data[i].count = count;
+            }
+        }
+    }
+
+    bool reproduced = fuzz_check(f, mismatch);
+    assert(reproduced);
+}
+
+static void fuzz_print_outcome(const char *name, const Fuzz_Outcome *o)
+{
+    const char *status = "limit";
+    if (o->status == EXEC_HALT) status = "halt";
+    if (o->status == EXEC_UNDERFLOW) status = "underflow";
+
+    String_Builder sb = {0};
+    for (size_t i = 0; i < o->tape.count; ++i) {
+        if (i > 0) sb_append_cstr(&sb, " ");
+        sb_append_symbol(&sb, o->tape.data[i]);
+    }
+    printf("    %-36s %s after %"PRIu64" steps in "SV_Fmt" at %zu: [%.*s]\n", name, status, o->steps, SV_Arg(o->state), o->head, (int) sb.count, sb.data);
+    free(sb.data);
+}
+
+static void fuzz_print_mismatch(const Fuzz *f, const Fuzz_Mismatch *mismatch)
+{
+    String_Builder sb = {0};
+    fuzz_render_program(f->tl, NULL, &sb);
+
+    printf("ERROR: %s disagrees with the reference interpreter", mismatch->engine->name);
+    if (mismatch->broken) printf(": %s", mismatch->broken);
+    printf("\nMinimized program, limited to %"PRIu64" steps:\n%.*s", f->limit, (int) sb.count, sb.data);
+    printf("Outcomes:\n");
+    fuzz_print_outcome("reference", &mismatch->expected);
+    if (mismatch->broken == NULL) fuzz_print_outcome(mismatch->engine->name, &mismatch->actual);
+    free(sb.data);
+}
+
+static void fuzz_usage(const char *program_name)
+{
+    printf("Usage: %s fuzz [OPTIONS]\n", program_name);
+    printf("OPTIONS:\n");
+    printf("    --iterations <n>    amount of random programs to check (default %d)\n", FUZZ_DEFAULT_ITERATIONS);
+    printf("    --steps <limit>     step budget of every program (default %d)\n", FUZZ_DEFAULT_STEPS);
+    printf("    --seed <seed>       seed of the generator (default: current time)\n");
+}
+
+int fuzz_main(const char *program_name, int argc, char **argv)
+{
+    size_t iterations = FUZZ_DEFAULT_ITERATIONS;
+    uint64_t steps_limit = FUZZ_DEFAULT_STEPS;
+    uint64_t seed = (uint64_t) time(NULL);
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (argc == 0) {
+            fuzz_usage(program_name);
+            printf("ERROR: no value was provided for %s\n", flag);
+            return 1;
+        }
+        const char *value = shift_args(&argc, &argv);
+        if (strcmp(flag, "--iterations") == 0) {
+            uint64_t count;
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            // Checking nothing must not pass for checking everything
+            if (count == 0 || count > SIZE_MAX) {
+                printf("ERROR: %s must be within 1..%zu\n", flag, (size_t) SIZE_MAX);
+                return 1;
+            }
+            iterations = count;
+        } else if (strcmp(flag, "--steps") == 0) {
+            if (!parse_count_flag(flag, value, &steps_limit)) return 1;
+        } else if (strcmp(flag, "--seed") == 0) {
+            if (!parse_count_flag(flag, value, &seed)) return 1;
+        } else {
+            fuzz_usage(program_name);
+            printf("ERROR: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+
+    char dir[] = "/tmp/turj-fuzz-XXXXXX";
+    if (mkdtemp(dir) == NULL) {
+        printf("ERROR: could not create scratch directory: %s\n", strerror(errno));
+        return 1;
+    }
+
+    printf("Fuzzing %zu engines with seed %"PRIu64"\n", FUZZ_ENGINES_COUNT, seed);
+    int result = 0;
+    Fuzz_Mismatch mismatch = {0};
+    for (size_t i = 0; i < iterations; ++i) {
+        Top_Level tl = {0};
+        // Every program is reproducible on its own
+        Fuzz f = {
+            .tl = &tl,
+            .limit = steps_limit,
+            .seed = mix64(seed + i),
+            .rng = mix64(seed + i),
+            .dir = dir,
+        };
+        fuzz_generate(&f, &tl);
+
+        if (fuzz_check(&f, &mismatch)) {
+            printf("Program %zu:\n", i);
+            fuzz_minimize(&f, &mismatch);
+            fuzz_print_mismatch(&f, &mismatch);
+            result = 1;
+        }
+        top_level_free(&tl);
+        if (result != 0) break;
+    }
+    if (result == 0) printf("OK: %zu programs, no mismatches\n", iterations);
+
+    free(mismatch.expected.tape.data);
+    free(mismatch.actual.tape.data);
+    rmdir(dir);
+    return result;
+}
@@ -0,0 +1,226 @@
+// # Time Travel
+//
+// Going back in time is done with two mechanisms:
+// - the Undo_Log reverts the most recent steps one by one;
+// - the snapshots of the configuration let us jump further back and replay forward from there.
+//   Only the first snapshot has the whole tape. Every other one has just the range of the cells
+//   the head visited since the previous snapshot, which is found by walking the Undo_Log back.
+//   The head moves one cell at a time, so the range is contiguous and the ranges of the
+//   neighbouring snapshots overlap. A snapshot is taken every `interval` steps until they take
+//   up `max_bytes`. Then they are thinned out so there are at most `per_level` of them per power
+//   of two of their age, halving it as many times as needed. The thrown away snapshot is merged
+//   into the next one, so any step is still reachable.
+
+#define HISTORY_UNDO_CAPACITY (1<<20)
+#define HISTORY_SNAPSHOT_INTERVAL (1<<16)
+#define HISTORY_SNAPSHOTS_MAX_BYTES ((size_t) 64<<20)
+
+typedef struct {
+    uint64_t steps;
+    Symbol_Id state;
+    size_t head;
+    size_t tape_count;
+    // The cells [start, start + cells.count) of the tape. The rest is the same as in the previous
+    // snapshot, or the `init` symbol past its end.
+    size_t start;
+    Cells cells;
+} Snapshot;
+
+typedef struct {
+    Snapshot *data;
+    size_t count;
+    size_t capacity;
+    Undo_Log undo;
+    uint64_t interval;
+    uint64_t next_snapshot;
+    size_t max_bytes;
+    size_t bytes;
+    // Zero means all the snapshots are kept
+    size_t per_level;
+} History;
+
+static size_t snapshot_bytes(const Snapshot *snapshot)
+{
+    return sizeof(*snapshot) + snapshot->cells.count*sizeof(*snapshot->cells.data);
+}
+
+// Merges the `older` snapshot into the `newer` one that comes right after it
+static void snapshot_merge(Snapshot *newer, Snapshot *older)
+{
+    size_t older_end = older->start + older->cells.count;
+    size_t newer_end = newer->start + newer->cells.count;
+    assert(older->start <= newer_end && newer->start <= older_end && "The ranges of the neighbouring snapshots overlap");
+    if (older->start >= newer->start && older_end <= newer_end) return;
+
+    Cells cells = {0};
+    size_t start = older->start < newer->start ? older->start : newer->start;
+    size_t end = older_end > newer_end ? older_end : newer_end;
+    tape_reserve(&cells, end - start);
+    cells.count = end - start;
+    memcpy(cells.data + (older->start - start), older->cells.data, older->cells.count*sizeof(*cells.data));
+    memcpy(cells.data + (newer->start - start), newer->cells.data, newer->cells.count*sizeof(*cells.data));
+    free(newer->cells.data);
+    newer->start = start;
+    newer->cells = cells;
+}
+
+static size_t history_level(uint64_t steps, const Snapshot *snapshot)
+{
+    uint64_t age = steps - snapshot->steps + 1;
+    return 64 - __builtin_clzll(age);
+}
+
+// Keeps at most `per_level` snapshots per level of their age. The very first snapshot is always
+// kept, because everything else is relative to it.
+static void history_thin(History *h, uint64_t steps)
+{
+    size_t per_level[65] = {0};
+    size_t kept = h->count;
+    for (size_t i = h->count; i-- > 1;) {
+        size_t level = history_level(steps, &h->data[i]);
+        if (per_level[level] < h->per_level) {
+            per_level[level] += 1;
+            h->data[--kept] = h->data[i];
+        } else {
+            h->bytes -= snapshot_bytes(&h->data[kept]) + snapshot_bytes(&h->data[i]);
+            snapshot_merge(&h->data[kept], &h->data[i]);
+            h->bytes += snapshot_bytes(&h->data[kept]);
+            free(h->data[i].cells.data);
+        }
+    }
+    memmove(&h->data[1], &h->data[kept], (h->count - kept)*sizeof(*h->data));
+    h->count = 1 + h->count - kept;
+}
+
+static void history_snapshot(History *h, const Exec *e)
+{
+    Snapshot snapshot = {
+        .steps = e->steps,
+        .state = e->state,
+        .head = e->head,
+        .tape_count = e->tape.count,
+    };
+
+    size_t start = 0;
+    size_t end = e->tape.count;
+    uint64_t since = h->count > 0 ? e->steps - h->data[h->count - 1].steps : UINT64_MAX;
+    // The Undo_Log may not go back far enough after the seeks, then the whole tape is taken
+    if (since <= h->undo.count) {
+        size_t head = e->head;
+        start = head;
+        end = head + 1;
+        for (uint64_t i = 0; i < since; ++i) {
+            Undo u = h->undo.data[(h->undo.top - 1 - i)&(h->undo.capacity - 1)];
+            head -= (int32_t) (u.state_delta&3) - 1;
+            if (head < start) start = head;
+            if (head + 1 > end) end = head + 1;
+        }
+    }
+    snapshot.start = start;
+    size_t count = end - start;
+    da_append_many(&snapshot.cells, e->tape.data + start, count);
+    da_append(h, snapshot);
+    h->bytes += snapshot_bytes(&snapshot);
+    h->next_snapshot = e->steps + h->interval;
+
+    if (h->per_level > 0) history_thin(h, e->steps);
+    while (h->bytes > h->max_bytes && h->per_level != 1) {
+        if (h->per_level == 0) {
+            size_t per_level[65] = {0};
+            for (size_t i = 1; i < h->count; ++i) {
+                size_t level = history_level(e->steps, &h->data[i]);
+                per_level[level] += 1;
+                if (per_level[level] > h->per_level) h->per_level = per_level[level];
+            }
+        }
+        h->per_level = h->per_level > 1 ? h->per_level/2 : 1;
+        history_thin(h, e->steps);
+    }
+}
+
+// The capacity of the Undo_Log must be a power of two
+void history_init_(History *h, Exec *e, size_t undo_capacity, uint64_t interval, size_t max_bytes)
+{
+    assert(e->m->states.count < (1u<<30) && "Undo packs the state id into 30 bits");
+    assert((undo_capacity&(undo_capacity - 1)) == 0 && interval > 0);
+    h->interval = interval;
+    h->max_bytes = max_bytes;
+    h->undo.capacity = undo_capacity;
+    h->undo.data = malloc(h->undo.capacity*sizeof(*h->undo.data));
+    assert(h->undo.data != NULL && "Buy more RAM lol");
+    e->undo = &h->undo;
+    // The Undo_Log and the snapshots work with the 32 bit cells
+    exec_widen(e);
+    exec_ensure_head(e);
+    history_snapshot(h, e);
+}
+
+void history_init(History *h, Exec *e)
+{
+    history_init_(h, e, HISTORY_UNDO_CAPACITY, HISTORY_SNAPSHOT_INTERVAL, HISTORY_SNAPSHOTS_MAX_BYTES);
+}
+
+void history_free(History *h, Exec *e)
+{
+    for (size_t i = 0; i < h->count; ++i) free(h->data[i].cells.data);
+    free(h->data);
+    free(h->undo.data);
+    e->undo = NULL;
+}
+
+// Rebuilds the configuration of the snapshot by applying all the snapshots up to it in order
+static void history_restore(History *h, size_t index, Exec *e)
+{
+    e->tape.count = 0;
+    for (size_t i = 0; i <= index; ++i) {
+        const Snapshot *it = &h->data[i];
+        tape_reserve(&e->tape, it->tape_count - e->tape.count);
+        while (e->tape.count < it->tape_count) e->tape.data[e->tape.count++] = e->init;
+        memcpy(e->tape.data + it->start, it->cells.data, it->cells.count*sizeof(*it->cells.data));
+    }
+    e->state = h->data[index].state;
+    e->head = h->data[index].head;
+    e->steps = h->data[index].steps;
+    h->undo.count = 0;
+}
+
+// Same as exec_run() but also takes the snapshots along the way.
+Exec_Status history_run(History *h, Exec *e, uint64_t limit, const Watches *watches)
+{
+    while (true) {
+        if (e->steps >= h->next_snapshot && e->steps > h->data[h->count - 1].steps) {
+            exec_ensure_head(e);
+            history_snapshot(h, e);
+        }
+        uint64_t chunk = h->next_snapshot > e->steps && h->next_snapshot < limit ? h->next_snapshot : limit;
+        Exec_Status status = exec_run(e, chunk, watches);
+        if (status != EXEC_LIMIT || e->steps >= limit) return status;
+    }
+}
+
+// Runs forward up to the `target` step ignoring breakpoints and watches.
+Exec_Status history_run_to(History *h, Exec *e, uint64_t target)
+{
+    Exec_Status status = history_run(h, e, target, NULL);
+    while (status == EXEC_BREAK) {
+        status = exec_step(e);
+        if (status == EXEC_OK) status = history_run(h, e, target, NULL);
+    }
+    return status == EXEC_LIMIT ? EXEC_OK : status;
+}
+
+// Moves the Machine to the `target` step in either direction.
+Exec_Status history_seek(History *h, Exec *e, uint64_t target)
+{
+    if (target >= e->steps) return history_run_to(h, e, target);
+
+    if (e->steps - target > h->undo.count) {
+        size_t i = h->count;
+        while (i-- > 0 && h->data[i].steps > target);
+        history_restore(h, i, e);
+        return history_run_to(h, e, target);
+    }
+
+    while (e->steps > target) exec_undo(e);
+    return EXEC_OK;
+}
@@ -17,6 +17,13 @@ typedef enum {
     TK_CCURLY,
     TK_FOR,
     TK_COLON,
+    TK_STAR,
+    TK_FILE,
+    TK_PIPE,
+    TK_AMPERSAND,
+    TK_MINUS,
+    TK_OPAREN,
+    TK_CPAREN,
     COUNT_TK,
 } Token_Kind;
 
@@ -38,6 +45,13 @@ const char *token_kind_display(Token_Kind kind, const char *file_path, size_t li
     case TK_CCURLY: return "CCURLY";
     case TK_FOR: return "FOR";
     case TK_COLON: return "COLON";
+    case TK_STAR: return "STAR";
+    case TK_FILE: return "FILE";
+    case TK_PIPE: return "PIPE";
+    case TK_AMPERSAND: return "AMPERSAND";
+    case TK_MINUS: return "MINUS";
+    case TK_OPAREN: return "OPAREN";
+    case TK_CPAREN: return "CPAREN";
     default: {
         printf("%s:%zu: Called in here\n", file_path, line);
         UNREACHABLE("Unknown Token_Kind %d", kind);
@@ -74,6 +88,10 @@ typedef struct {
     String_View content;
     String_View file_path;
     size_t cur, bol, row;
+    // Where the last chopped token begins
+    size_t token_start;
+    // Parsing one of the chunks of the file in parallel with the others. See parse_program().
+    bool speculative;
     Token peek_token;
     Lexer_Result peek_result;
     bool peek_full;
@@ -93,6 +111,13 @@ static Literal_Token LITERAL_TOKENS[] = {
     {SV_STATIC("{"),  TK_OCURLY},
     {SV_STATIC("}"),  TK_CCURLY},
     {SV_STATIC(":"),  TK_COLON},
+    {SV_STATIC("*"),  TK_STAR},
+    {SV_STATIC("|"),  TK_PIPE},
+    {SV_STATIC("&"),  TK_AMPERSAND},
+    // Goes after the arrows, so it does not take their first character
+    {SV_STATIC("-"),  TK_MINUS},
+    {SV_STATIC("("),  TK_OPAREN},
+    {SV_STATIC(")"),  TK_CPAREN},
 };
 #define LITERAL_TOKENS_COUNT (sizeof(LITERAL_TOKENS)/sizeof(LITERAL_TOKENS[0]))
 
@@ -160,6 +185,7 @@ Lexer_Result lexer_chop_token(Lexer *l, Token *t) {
         lexer_trim_left(l);
     }
 
+    l->token_start = l->cur;
     t->loc = lexer_loc(l);
     t->text.data = l->content.data + l->cur;
     t->text.count = 0;
@@ -201,6 +227,17 @@ Lexer_Result lexer_chop_token(Lexer *l, Token *t) {
         return LR_VALID;
     }
 
+    if (l->content.data[l->cur] == '@') {
+        t->kind = TK_FILE;
+        lexer_skip_char(l, 1);
+        t->text.data += 1;
+        while (l->cur < l->content.count && !isspace(l->content.data[l->cur])) {
+            lexer_skip_char(l, 1);
+            t->text.count += 1;
+        }
+        return LR_VALID;
+    }
+
     if (l->content.data[l->cur] == '\'') {
         t->kind = TK_SYMBOL;
         lexer_skip_char(l, 1);
@@ -213,7 +250,7 @@ Lexer_Result lexer_chop_token(Lexer *l, Token *t) {
             case '\\': {
                 lexer_skip_char(l, 1);
                 t->text.count += 1;
-                if (l->cur < l->content.count) return LR_UNCLOSED_STRING;
+                if (l->cur >= l->content.count) return LR_UNCLOSED_STRING;
                 lexer_skip_char(l, 1);
                 t->text.count += 1;
             } break;
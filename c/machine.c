@@ -0,0 +1,1019 @@
+// # Compiled Machine
+//
+// The rules produced by the parser are compiled into a dense transition table indexed by
+// (state, symbol). Every symbol text is interned into a small integer id, so the interpreter
+// never compares strings on the hot path. The programs that have way more (state, symbol) pairs
+// than rules get a hash table of just the pairs that have rules instead, so the generated
+// programs with 10^5 states and 10^3 symbols compile no matter how sparse they are.
+
+typedef uint32_t Symbol_Id;
+
+typedef struct {
+    String_View *data;
+    size_t count;
+    size_t capacity;
+    // Open addressing hash table of `id + 1`. Zero means the bucket is empty.
+    uint32_t *buckets;
+    size_t buckets_count;
+} Symbols;
+
+uint64_t sv_hash(String_View sv)
+{
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sv.count; ++i) {
+        hash ^= (uint8_t) sv.data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+uint64_t mix64(uint64_t x)
+{
+    // splitmix64 finalizer
+    x ^= x >> 30; x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27; x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+static void symbols_rehash(Symbols *s, size_t buckets_count)
+{
+    free(s->buckets);
+    s->buckets_count = buckets_count;
+    s->buckets = calloc(s->buckets_count, sizeof(*s->buckets));
+    assert(s->buckets != NULL && "Buy more RAM lol");
+    for (size_t id = 0; id < s->count; ++id) {
+        size_t i = sv_hash(s->data[id])&(s->buckets_count - 1);
+        while (s->buckets[i] != 0) i = (i + 1)&(s->buckets_count - 1);
+        s->buckets[i] = id + 1;
+    }
+}
+
+bool symbols_find(const Symbols *s, String_View text, Symbol_Id *id)
+{
+    if (s->buckets_count == 0) return false;
+    size_t i = sv_hash(text)&(s->buckets_count - 1);
+    while (s->buckets[i] != 0) {
+        if (sv_eq(s->data[s->buckets[i] - 1], text)) {
+            if (id) *id = s->buckets[i] - 1;
+            return true;
+        }
+        i = (i + 1)&(s->buckets_count - 1);
+    }
+    return false;
+}
+
+Symbol_Id symbols_intern(Symbols *s, String_View text)
+{
+    Symbol_Id id;
+    if (symbols_find(s, text, &id)) return id;
+
+    id = s->count;
+    da_append(s, text);
+    if (s->count*2 > s->buckets_count) {
+        symbols_rehash(s, s->buckets_count == 0 ? 64 : s->buckets_count*2);
+    } else {
+        size_t i = sv_hash(text)&(s->buckets_count - 1);
+        while (s->buckets[i] != 0) i = (i + 1)&(s->buckets_count - 1);
+        s->buckets[i] = id + 1;
+    }
+    return id;
+}
+
+// Appends the symbol the way it would be written in the source. The symbols that the lexer
+// would not read back as a single token are quoted. The texts of the quoted symbols keep their
+// escapes (see lexer_chop_token() and byte_symbol()), so they are written back as they are.
+void sb_append_symbol(String_Builder *sb, String_View symbol)
+{
+    bool plain = symbol.count > 0;
+    for (size_t i = 0; i < symbol.count; ++i) {
+        if (!is_symbol(symbol.data[i])) plain = false;
+    }
+    if (!plain) sb_append_cstr(sb, "'");
+    sb_append_buf(sb, symbol.data, symbol.count);
+    if (!plain) sb_append_cstr(sb, "'");
+}
+
+typedef enum {
+    TF_DEFINED = 1<<0,
+    TF_BREAK   = 1<<1,
+} Transition_Flag;
+
+typedef struct {
+    Symbol_Id write;
+    Symbol_Id next;
+    int32_t step;
+    // Anything other than exactly TF_DEFINED sends the interpreter to the slow path, so
+    // breakpoints cost nothing on the transitions that do not have them.
+    uint32_t flags;
+} Transition;
+
+// The programs with at most 256 (or 65536) states and symbols also get a copy of the table with
+// narrower fields and their runs keep the tape in equally narrow cells, so the table and the
+// tape take up a quarter (or a half) of the cache. See machine_compile_narrow() and exec_widen().
+#define NARROW_TYPES(bits)              \
+    typedef struct {                    \
+        uint##bits##_t write;           \
+        uint##bits##_t next;            \
+        int8_t step;                    \
+        uint8_t flags;                  \
+    } Transition##bits;                 \
+                                        \
+    typedef struct {                    \
+        uint##bits##_t *data;           \
+        size_t count;                   \
+        size_t capacity;                \
+    } Cells##bits
+
+NARROW_TYPES(8);
+NARROW_TYPES(16);
+
+// The dense table is used whenever it is this small or the rules fill at least 1/MACHINE_SPARSE_RATIO
+// of it
+#define MACHINE_DENSE_MAX_SLOTS (1<<20)
+#define MACHINE_SPARSE_RATIO 8
+
+typedef struct {
+    Symbols states;
+    Symbols alphabet;
+    // The first matching rule for every slot. See machine_slot().
+    Transition *table;
+    size_t slots_count;
+    // NULL for the dense table. Otherwise the table is an open addressing hash table and this
+    // is `state*alphabet.count + symbol + 1` of every bucket, zero for the empty ones.
+    uint64_t *keys;
+    // All the matching rules in the order of their definition. The ones for the (state, symbol)
+    // are alternatives[alternatives_start[slot]..alternatives_start[slot + 1]]. Compiled only
+    // on demand by `#nrun`.
+    uint32_t *alternatives_start;
+    Transition *alternatives;
+    // The narrow copies of the dense table. At most one of them is compiled.
+    Transition8 *table8;
+    Transition16 *table16;
+} Machine;
+
+// The slot of the (state, symbol) in the table. In the sparse table the pairs without rules end
+// up in an empty bucket, which holds an undefined Transition just like the dense table does.
+static inline size_t machine_slot(const Machine *m, Symbol_Id state, Symbol_Id read)
+{
+    uint64_t key = (uint64_t) state*m->alphabet.count + read;
+    if (m->keys == NULL) return key;
+    size_t mask = m->slots_count - 1;
+    size_t i = mix64(key)&mask;
+    while (m->keys[i] != 0 && m->keys[i] != key + 1) i = (i + 1)&mask;
+    return i;
+}
+
+// Same as machine_slot() but claims an empty bucket of the sparse table for the pair
+static size_t machine_slot_insert(Machine *m, Symbol_Id state, Symbol_Id read)
+{
+    size_t slot = machine_slot(m, state, read);
+    if (m->keys != NULL && m->keys[slot] == 0) m->keys[slot] = (uint64_t) state*m->alphabet.count + read + 1;
+    return slot;
+}
+
+// The (state, symbol) of the slot. Returns false for the empty buckets of the sparse table.
+static inline bool machine_slot_pair(const Machine *m, size_t slot, Symbol_Id *state, Symbol_Id *read)
+{
+    uint64_t key = slot;
+    if (m->keys != NULL) {
+        if (m->keys[slot] == 0) return false;
+        key = m->keys[slot] - 1;
+    }
+    *state = key/m->alphabet.count;
+    *read = key%m->alphabet.count;
+    return true;
+}
+
+static inline const Transition *machine_transition(const Machine *m, Symbol_Id state, Symbol_Id read)
+{
+    return &m->table[machine_slot(m, state, read)];
+}
+
+typedef struct {
+    Symbol_Id *data;
+    size_t count;
+    size_t capacity;
+} Cells;
+
+static void transition_from_rule(const Machine *m, const Rule *rule, Transition *t)
+{
+    symbols_find(&m->alphabet, rule->write.text, &t->write);
+    symbols_find(&m->states, rule->next.text, &t->next);
+    if (sv_eq(rule->step.text, SV("<-"))) {
+        t->step = -1;
+    } else if (sv_eq(rule->step.text, SV("->"))) {
+        t->step = 1;
+    } else {
+        UNREACHABLE("Unexpected arrow symbol");
+    }
+    t->flags |= TF_DEFINED;
+}
+
+#define BYTE_SYMBOLS_ROW(x) \
+    x+0x0, x+0x1, x+0x2, x+0x3, x+0x4, x+0x5, x+0x6, x+0x7, \
+    x+0x8, x+0x9, x+0xA, x+0xB, x+0xC, x+0xD, x+0xE, x+0xF
+
+// Every byte at its own index. Never written, so the serve workers may share it.
+static const uint8_t BYTE_SYMBOLS[256] = {
+    BYTE_SYMBOLS_ROW(0x00), BYTE_SYMBOLS_ROW(0x10), BYTE_SYMBOLS_ROW(0x20), BYTE_SYMBOLS_ROW(0x30),
+    BYTE_SYMBOLS_ROW(0x40), BYTE_SYMBOLS_ROW(0x50), BYTE_SYMBOLS_ROW(0x60), BYTE_SYMBOLS_ROW(0x70),
+    BYTE_SYMBOLS_ROW(0x80), BYTE_SYMBOLS_ROW(0x90), BYTE_SYMBOLS_ROW(0xA0), BYTE_SYMBOLS_ROW(0xB0),
+    BYTE_SYMBOLS_ROW(0xC0), BYTE_SYMBOLS_ROW(0xD0), BYTE_SYMBOLS_ROW(0xE0), BYTE_SYMBOLS_ROW(0xF0),
+};
+
+// The text of the symbol that consists of a single byte. The quote and the backslash are
+// escaped the same way the lexer leaves them in the text of a quoted symbol, so `'\''` in the
+// source is the same symbol as the quote byte of a tape file.
+static String_View byte_symbol(uint8_t byte)
+{
+    if (byte == '\'') return SV("\\'");
+    if (byte == '\\') return SV("\\\\");
+    return sv_from_parts((const char*) &BYTE_SYMBOLS[byte], 1);
+}
+
+static bool run_map_file(Run *run)
+{
+    bool result = true;
+    String_Builder path = {0};
+    sb_append_buf(&path, run->file.text.data, run->file.text.count);
+    sb_append_null(&path);
+
+    int fd = open(path.data, O_RDONLY);
+    if (fd < 0) return_defer(false);
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) return_defer(false);
+    if (st.st_size == 0) {
+        printf(Loc_Fmt": ERROR: tape file %s may not be empty, because we are using the last symbol as the symbol the entire infinite tape is initialized with.\n", Loc_Arg(run->file.loc), path.data);
+        close(fd);
+        free(path.data);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) return_defer(false);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    run->file_data = data;
+    run->file_size = st.st_size;
+    run->init = run->file;
+    run->init.kind = TK_SYMBOL;
+    run->init.text = byte_symbol(run->file_data[run->file_size - 1]);
+
+defer:
+    if (!result) printf(Loc_Fmt": ERROR: could not read tape file %s: %s\n", Loc_Arg(run->file.loc), path.data, strerror(errno));
+    if (fd >= 0) close(fd);
+    free(path.data);
+    return result;
+}
+
+// The initial tape is all that the file is needed for, so it is unmapped once the tape was
+// built from it. The symbols of the bytes live in BYTE_SYMBOLS and stay valid.
+void run_unmap_file(Run *run)
+{
+    if (run->file_data == NULL) return;
+    munmap((void*) run->file_data, run->file_size);
+    run->file_data = NULL;
+    run->file_size = 0;
+}
+
+// The narrowest cells that fit every state and symbol of the Machine
+unsigned machine_cell_bits(const Machine *m)
+{
+    size_t count = m->states.count > m->alphabet.count ? m->states.count : m->alphabet.count;
+    if (count <= (size_t) UINT8_MAX + 1) return 8;
+    if (count <= (size_t) UINT16_MAX + 1) return 16;
+    return 32;
+}
+
+#define narrow_table_compile(m, narrow)                                         \
+    do {                                                                        \
+        (narrow) = malloc((m)->slots_count*sizeof(*(narrow)));                  \
+        assert((narrow) != NULL && "Buy more RAM lol");                         \
+        for (size_t slot = 0; slot < (m)->slots_count; ++slot) {                \
+            (narrow)[slot].write = (m)->table[slot].write;                      \
+            (narrow)[slot].next = (m)->table[slot].next;                        \
+            (narrow)[slot].step = (m)->table[slot].step;                        \
+            (narrow)[slot].flags = (m)->table[slot].flags;                      \
+        }                                                                       \
+    } while (0)
+
+// (Re)compiles the narrow copy of the table with the given width of the cells. Has to be called
+// every time the table changes. 32 bits means no narrow copy at all.
+void machine_compile_narrow(Machine *m, unsigned bits)
+{
+    free(m->table8);
+    free(m->table16);
+    m->table8 = NULL;
+    m->table16 = NULL;
+
+    if (m->slots_count == 0 || m->keys != NULL) return;
+    // The narrow engines do not have the slow path for the breakpoints
+    for (size_t slot = 0; slot < m->slots_count; ++slot) {
+        if (m->table[slot].flags&TF_BREAK) return;
+    }
+
+    switch (bits) {
+    case 8:  narrow_table_compile(m, m->table8);  break;
+    case 16: narrow_table_compile(m, m->table16); break;
+    case 32: break;
+    default: UNREACHABLE("Unexpected width of the cells");
+    }
+}
+
+static size_t machine_rule_slot(Machine *m, const Rule *rule)
+{
+    Symbol_Id state, read;
+    symbols_find(&m->states, rule->state.text, &state);
+    symbols_find(&m->alphabet, rule->read.text, &read);
+    return machine_slot_insert(m, state, read);
+}
+
+// Allocates the empty table, either the dense one or the sparse one with room for `pairs_count`
+// pairs, whichever takes less memory. `sparse` forces the sparse one.
+static void machine_alloc_table(Machine *m, size_t pairs_count, bool sparse)
+{
+    m->slots_count = m->states.count*m->alphabet.count;
+    if (m->slots_count > MACHINE_DENSE_MAX_SLOTS && m->slots_count/MACHINE_SPARSE_RATIO > pairs_count) sparse = true;
+    if (sparse) {
+        // At most half full, so the probes stay short and there is always an empty bucket
+        m->slots_count = 2;
+        while (m->slots_count < 2*pairs_count) m->slots_count *= 2;
+        m->keys = calloc(m->slots_count, sizeof(*m->keys));
+        assert(m->keys != NULL && "Buy more RAM lol");
+    }
+    m->table = calloc(m->slots_count, sizeof(*m->table));
+    assert((m->table != NULL || m->slots_count == 0) && "Buy more RAM lol");
+}
+
+bool machine_compile_(Machine *m, Top_Level *tl, bool sparse)
+{
+    for (size_t i = 0; i < tl->rules.count; ++i) {
+        Rule *it = &tl->rules.data[i];
+        symbols_intern(&m->states, it->state.text);
+        symbols_intern(&m->states, it->next.text);
+        symbols_intern(&m->alphabet, it->read.text);
+        symbols_intern(&m->alphabet, it->write.text);
+    }
+    for (size_t i = 0; i < tl->runs.count; ++i) {
+        Run *it = &tl->runs.data[i];
+        symbols_intern(&m->states, it->state.text);
+        if (it->nondeterministic) symbols_intern(&m->states, it->accept.text);
+        if (it->file.text.count > 0) {
+            if (!run_map_file(it)) return false;
+            bool seen[256] = {0};
+            for (size_t j = 0; j < it->file_size; ++j) seen[it->file_data[j]] = true;
+            for (size_t byte = 0; byte < 256; ++byte) {
+                if (seen[byte]) symbols_intern(&m->alphabet, byte_symbol(byte));
+            }
+        } else {
+            for (size_t j = 0; j < it->tape.count; ++j) {
+                if (it->tape.data[j].group == 0) symbols_intern(&m->alphabet, it->tape.data[j].symbol.text);
+            }
+        }
+    }
+    for (size_t i = 0; i < tl->breakpoints.count; ++i) {
+        Breakpoint *it = &tl->breakpoints.data[i];
+        symbols_intern(&m->states, it->state.text);
+        if (!it->any_read) symbols_intern(&m->alphabet, it->read.text);
+    }
+
+    size_t pairs_count = tl->rules.count;
+    for (size_t i = 0; i < tl->breakpoints.count; ++i) {
+        pairs_count += tl->breakpoints.data[i].any_read ? m->alphabet.count : 1;
+    }
+    machine_alloc_table(m, pairs_count, sparse);
+
+    for (size_t i = 0; i < tl->rules.count; ++i) {
+        Rule *it = &tl->rules.data[i];
+        Transition *t = &m->table[machine_rule_slot(m, it)];
+        // The first rule wins, just like the linear scan over the rules used to behave
+        if (t->flags&TF_DEFINED) continue;
+
+        transition_from_rule(m, it, t);
+    }
+
+    for (size_t i = 0; i < tl->breakpoints.count; ++i) {
+        Breakpoint *it = &tl->breakpoints.data[i];
+        Symbol_Id state;
+        symbols_find(&m->states, it->state.text, &state);
+        if (it->any_read) {
+            for (Symbol_Id read = 0; read < m->alphabet.count; ++read) {
+                m->table[machine_slot_insert(m, state, read)].flags |= TF_BREAK;
+            }
+        } else {
+            Symbol_Id read;
+            symbols_find(&m->alphabet, it->read.text, &read);
+            m->table[machine_slot_insert(m, state, read)].flags |= TF_BREAK;
+        }
+    }
+
+    machine_compile_narrow(m, machine_cell_bits(m));
+    return true;
+}
+
+bool machine_compile(Machine *m, Top_Level *tl)
+{
+    return machine_compile_(m, tl, false);
+}
+
+void machine_compile_alternatives(Machine *m, const Top_Level *tl)
+{
+    if (m->alternatives_start != NULL) return;
+
+    size_t slots_count = m->slots_count;
+    m->alternatives_start = calloc(slots_count + 1, sizeof(*m->alternatives_start));
+    m->alternatives = calloc(tl->rules.count, sizeof(*m->alternatives));
+    assert(m->alternatives_start != NULL && "Buy more RAM lol");
+    assert(m->alternatives != NULL && "Buy more RAM lol");
+
+    for (size_t i = 0; i < tl->rules.count; ++i) {
+        m->alternatives_start[machine_rule_slot(m, &tl->rules.data[i]) + 1] += 1;
+    }
+    for (size_t slot = 0; slot < slots_count; ++slot) {
+        m->alternatives_start[slot + 1] += m->alternatives_start[slot];
+    }
+
+    uint32_t *fill = calloc(slots_count, sizeof(*fill));
+    assert(fill != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < tl->rules.count; ++i) {
+        Rule *it = &tl->rules.data[i];
+        size_t slot = machine_rule_slot(m, it);
+        transition_from_rule(m, it, &m->alternatives[m->alternatives_start[slot] + fill[slot]++]);
+    }
+    free(fill);
+}
+
+void machine_free(Machine *m)
+{
+    free(m->states.data);
+    free(m->states.buckets);
+    free(m->alphabet.data);
+    free(m->alphabet.buckets);
+    free(m->table);
+    free(m->keys);
+    free(m->alternatives_start);
+    free(m->alternatives);
+    free(m->table8);
+    free(m->table16);
+    memset(m, 0, sizeof(*m));
+}
+
+// # Execution
+
+typedef enum {
+    EXEC_OK = 0,
+    EXEC_HALT,
+    EXEC_UNDERFLOW,
+    EXEC_BREAK,
+    EXEC_WATCH,
+    EXEC_LIMIT,
+} Exec_Status;
+
+// What it takes to revert a single step
+typedef struct {
+    Symbol_Id overwritten;
+    // The previous state shifted left by 2 with the head delta + 1 in the lower bits.
+    // The delta is 0 only for the step that underflowed the tape.
+    uint32_t state_delta;
+} Undo;
+
+// Ring buffer of the most recent steps. Older steps are forgotten, so the memory stays bounded
+// no matter how long the Machine runs.
+typedef struct {
+    Undo *data;
+    size_t capacity;
+    size_t top;
+    size_t count;
+} Undo_Log;
+
+static inline void undo_log_push(Undo_Log *log, Symbol_Id overwritten, Symbol_Id state, int32_t delta)
+{
+    log->data[log->top] = (Undo) {
+        .overwritten = overwritten,
+        .state_delta = (state<<2) | (uint32_t) (delta + 1),
+    };
+    log->top = (log->top + 1)&(log->capacity - 1);
+    if (log->count < log->capacity) log->count += 1;
+}
+
+static inline Undo undo_log_pop(Undo_Log *log)
+{
+    assert(log->count > 0);
+    log->top = (log->top - 1)&(log->capacity - 1);
+    log->count -= 1;
+    return log->data[log->top];
+}
+
+typedef struct {
+    uint64_t *data;
+    size_t count;
+    size_t capacity;
+} Counts;
+
+#define TAPE_STATS_SAMPLES 1024
+#define TAPE_STATS_BUCKETS 256
+#define TAPE_STATS_SWEEP_BINS 64
+
+// How the Machine uses its tape. Collected only on demand, see stats.c. Takes the same amount
+// of memory no matter how long the run is or how much tape it uses.
+typedef struct {
+    // How many steps were taken from every bucket of 2^`shift` cells. The buckets are merged
+    // pairwise and the width doubles whenever the head goes past the last one.
+    uint64_t visits[TAPE_STATS_BUCKETS];
+    unsigned shift;
+    // One past the rightmost cell the head has been on
+    size_t cells;
+    // Lengths of the sweeps of the head between the reversals of its direction. The bin `k`
+    // counts the sweeps of [2^k, 2^(k+1)) steps.
+    uint64_t sweeps[TAPE_STATS_SWEEP_BINS];
+    uint64_t sweeps_count;
+    uint64_t sweeps_min;
+    uint64_t sweeps_max;
+    uint64_t sweeps_sum;
+    uint64_t sweep;
+    int32_t direction;
+    // Pairs of (steps, tape size) sampled every `interval` steps. The interval doubles every
+    // time there are too many samples, so the memory stays bounded.
+    Counts growth;
+    uint64_t interval;
+} Tape_Stats;
+
+static void tape_stats_widen(Tape_Stats *s)
+{
+    for (size_t i = 0; i < TAPE_STATS_BUCKETS/2; ++i) {
+        s->visits[i] = s->visits[2*i] + s->visits[2*i + 1];
+    }
+    memset(&s->visits[TAPE_STATS_BUCKETS/2], 0, TAPE_STATS_BUCKETS/2*sizeof(*s->visits));
+    s->shift += 1;
+}
+
+static void tape_stats_sweep(Tape_Stats *s, uint64_t sweep)
+{
+    s->sweeps[63 - __builtin_clzll(sweep)] += 1;
+    if (s->sweeps_count == 0 || sweep < s->sweeps_min) s->sweeps_min = sweep;
+    if (sweep > s->sweeps_max) s->sweeps_max = sweep;
+    s->sweeps_count += 1;
+    s->sweeps_sum += sweep;
+}
+
+static inline void tape_stats_step(Tape_Stats *s, size_t head, int32_t delta, uint64_t steps, size_t tape_count)
+{
+    while ((head>>s->shift) >= TAPE_STATS_BUCKETS) tape_stats_widen(s);
+    s->visits[head>>s->shift] += 1;
+    if (head >= s->cells) s->cells = head + 1;
+
+    if (delta != 0) {
+        if (delta != s->direction && s->sweep > 0) {
+            tape_stats_sweep(s, s->sweep);
+            s->sweep = 0;
+        }
+        s->direction = delta;
+        s->sweep += 1;
+    }
+
+    if (s->interval == 0) s->interval = 1;
+    if ((steps&(s->interval - 1)) == 0) {
+        if (s->growth.count >= 2*TAPE_STATS_SAMPLES) {
+            for (size_t i = 0; i < TAPE_STATS_SAMPLES/2; ++i) {
+                s->growth.data[2*i] = s->growth.data[4*i + 2];
+                s->growth.data[2*i + 1] = s->growth.data[4*i + 3];
+            }
+            s->growth.count = TAPE_STATS_SAMPLES;
+            s->interval *= 2;
+        }
+        if ((steps&(s->interval - 1)) == 0) {
+            da_append(&s->growth, steps);
+            da_append(&s->growth, tape_count);
+        }
+    }
+}
+
+typedef struct {
+    const Machine *m;
+    // The tape lives in exactly one of these. `bits` is the width of its cells, which is picked
+    // by exec_from_run() to match the narrow table of the Machine.
+    Cells tape;
+    Cells8 tape8;
+    Cells16 tape16;
+    unsigned bits;
+    Symbol_Id init;
+    Symbol_Id state;
+    size_t head;
+    uint64_t steps;
+    // Records every step when not NULL
+    Undo_Log *undo;
+    // Counts the steps taken from every (state, symbol) when not NULL. See profile.c.
+    uint64_t *counts;
+    Tape_Stats *stats;
+    bool spilled;
+} Exec;
+
+static inline size_t exec_tape_count(const Exec *e)
+{
+    switch (e->bits) {
+    case 8:  return e->tape8.count;
+    case 16: return e->tape16.count;
+    default: return e->tape.count;
+    }
+}
+
+static inline Symbol_Id exec_cell(const Exec *e, size_t i)
+{
+    switch (e->bits) {
+    case 8:  return e->tape8.data[i];
+    case 16: return e->tape16.data[i];
+    default: return e->tape.data[i];
+    }
+}
+
+static inline void exec_set_cell(Exec *e, size_t i, Symbol_Id symbol)
+{
+    switch (e->bits) {
+    case 8:  e->tape8.data[i] = symbol;  break;
+    case 16: e->tape16.data[i] = symbol; break;
+    default: e->tape.data[i] = symbol;
+    }
+}
+
+// The spilled tape can not be moved, so the run stops when the head leaves its mapping
+static void exec_spill_full(const Exec *e)
+{
+    printf("ERROR: the head went past the %zu cells reserved for the spilled tape after %"PRIu64" steps. Reserve more of them with --tape-spill-size.\n", e->tape.capacity, e->steps);
+    exit(1);
+}
+
+static inline void exec_ensure_head(Exec *e)
+{
+    switch (e->bits) {
+    case 8:  while (e->head >= e->tape8.count) da_append(&e->tape8, e->init);  break;
+    case 16: while (e->head >= e->tape16.count) da_append(&e->tape16, e->init); break;
+    default:
+        if (e->spilled && e->head >= e->tape.capacity) exec_spill_full(e);
+        while (e->head >= e->tape.count) da_append(&e->tape, e->init);
+    }
+}
+
+// Converts the tape between the 32 bit cells and the narrow ones in place, so there is never
+// more than one copy of it. The narrow cells are packed from the beginning of the buffer and the
+// wide ones are spread from its end, so every cell is read before it is overwritten. The cells
+// are moved with memcpy(), because the buffer is accessed as both types at the same time.
+#define exec_narrow_tape(e, narrow)                                                     \
+    do {                                                                                \
+        (narrow)->data = (void*) (e)->tape.data;                                        \
+        (narrow)->count = (e)->tape.count;                                              \
+        (narrow)->capacity = (e)->tape.capacity*sizeof(Symbol_Id)/sizeof(*(narrow)->data); \
+        for (size_t i = 0; i < (narrow)->count; ++i) {                                  \
+            __typeof__(*(narrow)->data) cell = (e)->tape.data[i];                       \
+            memcpy((char*) (narrow)->data + i*sizeof(cell), &cell, sizeof(cell));       \
+        }                                                                               \
+        (e)->tape = (Cells) {0};                                                        \
+    } while (0)
+
+#define exec_widen_tape(e, narrow)                                                      \
+    do {                                                                                \
+        size_t capacity = (narrow)->capacity > (narrow)->count ? (narrow)->capacity : (narrow)->count; \
+        (e)->tape.count = (narrow)->count;                                              \
+        (e)->tape.capacity = capacity;                                                  \
+        (e)->tape.data = realloc((narrow)->data, capacity*sizeof(Symbol_Id));           \
+        assert(((e)->tape.data != NULL || capacity == 0) && "Buy more RAM lol");        \
+        for (size_t i = (e)->tape.count; i-- > 0;) {                                    \
+            __typeof__(*(narrow)->data) cell;                                           \
+            memcpy(&cell, (char*) (e)->tape.data + i*sizeof(cell), sizeof(cell));       \
+            (e)->tape.data[i] = cell;                                                   \
+        }                                                                               \
+        *(narrow) = (__typeof__(*(narrow))) {0};                                        \
+    } while (0)
+
+// Moves the tape into the 32 bit cells for good. Everything that needs the tape as Cells, like
+// the trace, the debugger, the cache and the statistics, calls this first.
+void exec_widen(Exec *e)
+{
+    switch (e->bits) {
+    case 8:  exec_widen_tape(e, &e->tape8);  break;
+    case 16: exec_widen_tape(e, &e->tape16); break;
+    default: break;
+    }
+    e->bits = 32;
+}
+
+static void tape_reserve(Cells *tape, size_t count)
+{
+    if (tape->count + count <= tape->capacity) return;
+    if (tape->capacity == 0) tape->capacity = DA_INIT_CAP;
+    while (tape->count + count > tape->capacity) tape->capacity *= 2;
+    tape->data = realloc(tape->data, tape->capacity*sizeof(*tape->data));
+    assert(tape->data != NULL && "Buy more RAM lol");
+}
+
+// The number of cells tape_expand_segments() appends for `segments` is added to `count`,
+// saturating at SIZE_MAX. Returns how many segments it took.
+static size_t tape_count_segments(const Tape_Segment *segments, size_t *count)
+{
+    const Tape_Segment *it = &segments[0];
+    size_t cells = 1;
+    if (it->group > 0) {
+        cells = 0;
+        for (size_t j = 1; j <= it->group;) {
+            j += tape_count_segments(&segments[j], &cells);
+        }
+    }
+    cells = cells > 0 && it->count > SIZE_MAX/cells ? SIZE_MAX : cells*it->count;
+    *count = *count > SIZE_MAX - cells ? SIZE_MAX : *count + cells;
+    return it->group > 0 ? 1 + it->group : 1;
+}
+
+static size_t tape_expand_segments(const Machine *m, const Tape_Segment *segments, Cells *tape)
+{
+    const Tape_Segment *it = &segments[0];
+    if (it->group > 0) {
+        for (size_t i = 0; i < it->count; ++i) {
+            for (size_t j = 1; j <= it->group;) {
+                j += tape_expand_segments(m, &segments[j], tape);
+            }
+        }
+        return 1 + it->group;
+    }
+
+    Symbol_Id id;
+    symbols_find(&m->alphabet, it->symbol.text, &id);
+    tape_reserve(tape, it->count);
+    for (size_t i = 0; i < it->count; ++i) tape->data[tape->count++] = id;
+    return 1;
+}
+
+size_t run_initial_tape_count(const Run *run)
+{
+    if (run->file_data != NULL) return run->file_size;
+    size_t count = 0;
+    for (size_t i = 0; i < run->tape.count;) {
+        i += tape_count_segments(&run->tape.data[i], &count);
+    }
+    return count;
+}
+
+void run_initial_tape(const Machine *m, const Run *run, Cells *tape)
+{
+    tape->count = 0;
+    if (run->file_data != NULL) {
+        // Translating the bytes through a table keeps this bound by the memory bandwidth
+        Symbol_Id ids[256] = {0};
+        for (size_t byte = 0; byte < 256; ++byte) symbols_find(&m->alphabet, byte_symbol(byte), &ids[byte]);
+        tape_reserve(tape, run->file_size);
+        for (size_t i = 0; i < run->file_size; ++i) tape->data[i] = ids[run->file_data[i]];
+        tape->count = run->file_size;
+    } else {
+        for (size_t i = 0; i < run->tape.count;) {
+            i += tape_expand_segments(m, &run->tape.data[i], tape);
+        }
+    }
+}
+
+// # Spilled Tape
+//
+// Instead of the heap the tape may live in a memory mapped sparse file, so the kernel can page
+// the regions of the tape the head is not visiting out to the disk. The whole address range is
+// reserved upfront, so the tape never has to be moved. exec_ensure_head() stops the run instead
+// of letting da_append() reallocate it once the head leaves the reserved range.
+
+#define TAPE_SPILL_CAPACITY ((size_t) 1<<38)
+#define TAPE_SPILL_MIN_CAPACITY ((size_t) 1<<20)
+
+typedef struct {
+    const char *path;
+    // How many cells to reserve. 0 reserves TAPE_SPILL_CAPACITY of them.
+    size_t capacity;
+} Tape_Spill;
+
+// `initial` is the number of cells the tape needs right away
+bool tape_spill_open(Cells *tape, const Tape_Spill *spill, size_t initial)
+{
+    size_t requested = spill->capacity > 0 ? spill->capacity : TAPE_SPILL_CAPACITY;
+    if (requested < initial) {
+        printf("ERROR: the initial tape of %zu cells does not fit into the %zu cells reserved for the spilled tape. Reserve more of them with --tape-spill-size.\n", initial, requested);
+        return false;
+    }
+
+    size_t capacity = requested;
+    void *data = MAP_FAILED;
+    int fd = open(spill->path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) goto fail;
+    // The file is sparse, so only the pages that were actually written take up the disk space.
+    // Not every file system or address space limit allows for the whole reservation though, so
+    // settle for less as long as the initial tape still fits.
+    while (true) {
+        if (ftruncate(fd, capacity*sizeof(*tape->data)) == 0) {
+            data = mmap(NULL, capacity*sizeof(*tape->data), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (data != MAP_FAILED) break;
+        }
+        if (capacity <= TAPE_SPILL_MIN_CAPACITY || capacity/2 < initial) goto fail;
+        capacity /= 2;
+    }
+    if (capacity < requested) {
+        printf("WARNING: could reserve only %zu of the %zu cells requested for the spilled tape in %s\n", capacity, requested, spill->path);
+    }
+    // The Machines mostly sweep the tape back and forth, so read ahead aggressively and drop
+    // the pages soon after they were accessed
+    madvise(data, capacity*sizeof(*tape->data), MADV_SEQUENTIAL);
+    // The mapping keeps the file alive, but nobody else needs to see it
+    unlink(spill->path);
+    close(fd);
+
+    tape->data = data;
+    tape->count = 0;
+    tape->capacity = capacity;
+    return true;
+
+fail:
+    printf("ERROR: could not create tape spill file %s with %zu cells: %s\n", spill->path, capacity, strerror(errno));
+    if (fd >= 0) {
+        printf("NOTE: reserve fewer cells with --tape-spill-size or put the file on another file system\n");
+        close(fd);
+        unlink(spill->path);
+    }
+    return false;
+}
+
+void tape_spill_close(Cells *tape)
+{
+    munmap(tape->data, tape->capacity*sizeof(*tape->data));
+    memset(tape, 0, sizeof(*tape));
+}
+
+// `spill` is where the tape is spilled to. NULL keeps the tape on the heap.
+bool exec_from_run(const Machine *m, const Run *run, const Tape_Spill *spill, Exec *e)
+{
+    *e = (Exec) { .m = m };
+    if (spill != NULL) {
+        if (!tape_spill_open(&e->tape, spill, run_initial_tape_count(run))) return false;
+        e->spilled = true;
+    }
+    symbols_find(&m->states, run->state.text, &e->state);
+    symbols_find(&m->alphabet, run->init.text, &e->init);
+    run_initial_tape(m, run, &e->tape);
+
+    // The spilled tapes are too big to be moved around
+    e->bits = 32;
+    if (!e->spilled && m->table8) {
+        exec_narrow_tape(e, &e->tape8);
+        e->bits = 8;
+    } else if (!e->spilled && m->table16) {
+        exec_narrow_tape(e, &e->tape16);
+        e->bits = 16;
+    }
+    return true;
+}
+
+void exec_free(Exec *e)
+{
+    if (e->spilled) {
+        tape_spill_close(&e->tape);
+    } else {
+        free(e->tape.data);
+        free(e->tape8.data);
+        free(e->tape16.data);
+    }
+}
+
+// Performs exactly one step ignoring the breakpoints.
+Exec_Status exec_step(Exec *e)
+{
+    exec_ensure_head(e);
+    Symbol_Id read = exec_cell(e, e->head);
+    size_t slot = machine_slot(e->m, e->state, read);
+    Transition t = e->m->table[slot];
+    if (!(t.flags&TF_DEFINED)) return EXEC_HALT;
+    int32_t delta = t.step < 0 && e->head == 0 ? 0 : t.step;
+    if (e->undo) undo_log_push(e->undo, read, e->state, delta);
+    if (e->counts) e->counts[slot] += 1;
+    exec_set_cell(e, e->head, t.write);
+    e->state = t.next;
+    e->steps += 1;
+    if (e->stats) tape_stats_step(e->stats, e->head, delta, e->steps, exec_tape_count(e));
+    if (delta == 0) return EXEC_UNDERFLOW;
+    e->head += delta;
+    return EXEC_OK;
+}
+
+// Reverts the last recorded step. Returns false if the Undo_Log has nothing left.
+bool exec_undo(Exec *e)
+{
+    if (e->undo == NULL || e->undo->count == 0) return false;
+    Undo u = undo_log_pop(e->undo);
+    e->head -= (int32_t) (u.state_delta&3) - 1;
+    exec_set_cell(e, e->head, u.overwritten);
+    e->state = u.state_delta>>2;
+    e->steps -= 1;
+    return true;
+}
+
+static inline Exec_Status exec_run_(Exec *e, uint64_t limit, const Watches *watches, bool watching, bool recording, bool counting, bool instrumenting, bool sparse)
+{
+    const Transition *table = e->m->table;
+    size_t alphabet_count = e->m->alphabet.count;
+    Symbol_Id state = e->state;
+    size_t head = e->head;
+    uint64_t steps = e->steps;
+    Exec_Status status = EXEC_LIMIT;
+
+    while (steps < limit) {
+        if (head >= e->tape.count) {
+            e->head = head;
+            e->steps = steps;
+            exec_ensure_head(e);
+        }
+        Symbol_Id *cell = &e->tape.data[head];
+        size_t slot = sparse ? machine_slot(e->m, state, *cell) : (size_t) state*alphabet_count + *cell;
+        Transition t = table[slot];
+        if (t.flags != TF_DEFINED) {
+            if (t.flags&TF_BREAK) { status = EXEC_BREAK; break; }
+            if (!(t.flags&TF_DEFINED)) { status = EXEC_HALT; break; }
+        }
+
+        bool hit = false;
+        if (watching && t.write != *cell) {
+            for (size_t i = 0; i < watches->count; ++i) {
+                if (watches->data[i].cell == head) hit = true;
+            }
+        }
+
+        int32_t delta = t.step < 0 && head == 0 ? 0 : t.step;
+        if (recording) undo_log_push(e->undo, *cell, state, delta);
+        if (counting) e->counts[slot] += 1;
+        *cell = t.write;
+        state = t.next;
+        steps += 1;
+        if (instrumenting) tape_stats_step(e->stats, head, delta, steps, e->tape.count);
+        if (delta == 0) { status = EXEC_UNDERFLOW; break; }
+        head += delta;
+        if (hit) { status = EXEC_WATCH; break; }
+    }
+
+    e->state = state;
+    e->head = head;
+    e->steps = steps;
+    return status;
+}
+
+// The specializations of the plain exec_run_() for the narrow tables and tapes
+#define EXEC_RUN_NARROW(bits)                                                       \
+    static Exec_Status exec_run##bits(Exec *e, uint64_t limit)                      \
+    {                                                                               \
+        const Transition##bits *table = e->m->table##bits;                          \
+        size_t alphabet_count = e->m->alphabet.count;                               \
+        uint##bits##_t init = e->init;                                              \
+        Cells##bits tape = e->tape##bits;                                           \
+        Symbol_Id state = e->state;                                                 \
+        size_t head = e->head;                                                      \
+        uint64_t steps = e->steps;                                                  \
+        Exec_Status status = EXEC_LIMIT;                                            \
+                                                                                    \
+        while (steps < limit) {                                                     \
+            while (head >= tape.count) da_append(&tape, init);                      \
+            uint##bits##_t *cell = &tape.data[head];                                \
+            Transition##bits t = table[(size_t) state*alphabet_count + *cell];      \
+            if (!(t.flags&TF_DEFINED)) { status = EXEC_HALT; break; }               \
+                                                                                    \
+            int32_t delta = t.step < 0 && head == 0 ? 0 : t.step;                   \
+            *cell = t.write;                                                        \
+            state = t.next;                                                         \
+            steps += 1;                                                             \
+            if (delta == 0) { status = EXEC_UNDERFLOW; break; }                     \
+            head += delta;                                                          \
+        }                                                                           \
+                                                                                    \
+        e->tape##bits = tape;                                                       \
+        e->state = state;                                                           \
+        e->head = head;                                                             \
+        e->steps = steps;                                                           \
+        return status;                                                              \
+    }
+
+EXEC_RUN_NARROW(8)
+EXEC_RUN_NARROW(16)
+
+// Runs until the Machine halts, hits a breakpoint or a watch, or performs `limit` steps in total.
+Exec_Status exec_run(Exec *e, uint64_t limit, const Watches *watches)
+{
+    bool watching = watches != NULL && watches->count > 0;
+    bool recording = e->undo != NULL;
+    if (!watching && !recording && e->counts == NULL && e->stats == NULL) {
+        if (e->bits == 8 && e->m->table8) return exec_run8(e, limit);
+        if (e->bits == 16 && e->m->table16) return exec_run16(e, limit);
+    }
+    // The narrow engines do not do any of the above
+    exec_widen(e);
+    // Profiling, instrumentation and the sparse tables are slow anyway, so they do not get
+    // specializations of their own
+    if (e->counts || e->stats || e->m->keys) {
+        return exec_run_(e, limit, watches, watching, recording, e->counts != NULL, e->stats != NULL, e->m->keys != NULL);
+    }
+    if (watching) {
+        if (recording) return exec_run_(e, limit, watches, true, true, false, false, false);
+        return exec_run_(e, limit, watches, true, false, false, false, false);
+    }
+    if (recording) return exec_run_(e, limit, NULL, false, true, false, false, false);
+    return exec_run_(e, limit, NULL, false, false, false, false, false);
+}
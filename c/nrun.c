@@ -0,0 +1,329 @@
+// # Nondeterministic Run
+//
+// `#nrun` explores the tree of configurations breadth-first, so the first time the accepting
+// state is reached the path to it is the shortest one. Every level of the tree is expanded in
+// parallel by a pool of workers. The level is split evenly between them and whoever finishes
+// their part early steals the chunks of the others.
+//
+// The configurations are deduplicated by a 64-bit hash of the state, the head and the tape.
+// The tape hash is updated incrementally on every write, so hashing does not depend on the
+// size of the tape. The branches share the tape until one of them writes a different symbol.
+
+#define NRUN_MAX_CONFIGS (1<<21)
+#define NRUN_CHUNK 64
+
+typedef struct {
+    atomic_size_t refs;
+    size_t count;
+    Symbol_Id cells[];
+} Shared_Tape;
+
+static Shared_Tape *shared_tape_alloc(size_t count)
+{
+    Shared_Tape *tape = malloc(sizeof(Shared_Tape) + count*sizeof(Symbol_Id));
+    assert(tape != NULL && "Buy more RAM lol");
+    atomic_init(&tape->refs, 1);
+    tape->count = count;
+    return tape;
+}
+
+static void shared_tape_release(Shared_Tape *tape)
+{
+    if (atomic_fetch_sub(&tape->refs, 1) == 1) free(tape);
+}
+
+typedef struct Config Config;
+
+struct Config {
+    Config *parent;
+    Shared_Tape *tape;
+    uint64_t tape_hash;
+    size_t head;
+    Symbol_Id state;
+    // How we got here from the parent
+    Symbol_Id read;
+    Transition via;
+};
+
+typedef struct {
+    Config **data;
+    size_t count;
+    size_t capacity;
+} Configs;
+
+typedef struct {
+    const Machine *m;
+    Symbol_Id init;
+    Symbol_Id accept;
+
+    Config *root;
+    Configs frontier;
+    // Of the configurations in the frontier
+    size_t depth;
+    size_t workers_count;
+    atomic_size_t *cursors;
+    size_t *ends;
+    // Per worker
+    Configs *next;
+    Configs *allocated;
+
+    _Atomic uint64_t *visited;
+    size_t visited_capacity;
+    atomic_size_t explored;
+    _Atomic(Config*) found;
+
+    bool done;
+    pthread_barrier_t start;
+    pthread_barrier_t finish;
+} Nrun;
+
+// The infinite tail of `init`s does not contribute to the hash, so tapes that differ only in
+// how far they have been materialized are considered the same. mix64() maps 0 to 0, so the
+// symbol 0 in the cell 0 is offset not to look like an `init` as well. The offset is not the
+// one of config_hash(), otherwise a cell would cancel out the head and the state of the same
+// numbers.
+static inline uint64_t cell_hash(const Nrun *n, size_t index, Symbol_Id symbol)
+{
+    if (symbol == n->init) return 0;
+    return mix64((((uint64_t) index<<32) ^ symbol) + 0xd1b54a32d192ed03ULL);
+}
+
+static inline uint64_t config_hash(uint64_t tape_hash, Symbol_Id state, size_t head)
+{
+    uint64_t hash = tape_hash ^ mix64(((uint64_t) head<<32 | state) + 0x9e3779b97f4a7c15ULL);
+    return hash == 0 ? 1 : hash;
+}
+
+// Returns true if the hash was not in the set yet
+static bool visited_insert(Nrun *n, uint64_t hash)
+{
+    size_t mask = n->visited_capacity - 1;
+    for (size_t i = hash&mask;; i = (i + 1)&mask) {
+        uint64_t expected = 0;
+        if (atomic_compare_exchange_strong(&n->visited[i], &expected, hash)) return true;
+        if (expected == hash) return false;
+    }
+}
+
+static void nrun_expand(Nrun *n, Config *config, size_t worker)
+{
+    const Machine *m = n->m;
+    Shared_Tape *tape = config->tape;
+    Symbol_Id read = config->head < tape->count ? tape->cells[config->head] : n->init;
+    size_t slot = machine_slot(m, config->state, read);
+
+    for (uint32_t i = m->alternatives_start[slot]; i < m->alternatives_start[slot + 1]; ++i) {
+        if (atomic_load(&n->found) != NULL) return;
+        if (atomic_load(&n->explored) >= NRUN_MAX_CONFIGS) return;
+
+        Transition t = m->alternatives[i];
+        bool underflow = t.step < 0 && config->head == 0;
+        size_t head = underflow ? 0 : config->head + t.step;
+        uint64_t tape_hash = config->tape_hash ^ cell_hash(n, config->head, read) ^ cell_hash(n, config->head, t.write);
+
+        if (!visited_insert(n, config_hash(tape_hash, t.next, underflow ? SIZE_MAX : head))) continue;
+        atomic_fetch_add(&n->explored, 1);
+
+        Config *child = malloc(sizeof(*child));
+        assert(child != NULL && "Buy more RAM lol");
+        *child = (Config) {
+            .parent = config,
+            .tape_hash = tape_hash,
+            .head = head,
+            .state = t.next,
+            .read = read,
+            .via = t,
+        };
+        da_append(&n->allocated[worker], child);
+
+        if (t.next == n->accept) {
+            Config *expected = NULL;
+            atomic_compare_exchange_strong(&n->found, &expected, child);
+            return;
+        }
+        // The branch that fell off the left end of the tape halts
+        if (underflow) continue;
+
+        if (t.write == read) {
+            atomic_fetch_add(&tape->refs, 1);
+            child->tape = tape;
+        } else {
+            size_t count = config->head < tape->count ? tape->count : config->head + 1;
+            child->tape = shared_tape_alloc(count);
+            memcpy(child->tape->cells, tape->cells, tape->count*sizeof(Symbol_Id));
+            for (size_t j = tape->count; j < count; ++j) child->tape->cells[j] = n->init;
+            child->tape->cells[config->head] = t.write;
+        }
+        da_append(&n->next[worker], child);
+    }
+}
+
+typedef struct {
+    Nrun *n;
+    size_t index;
+} Nrun_Worker;
+
+static void *nrun_worker(void *arg)
+{
+    Nrun_Worker *w = arg;
+    Nrun *n = w->n;
+    while (true) {
+        pthread_barrier_wait(&n->start);
+        if (n->done) break;
+
+        for (size_t k = 0; k < n->workers_count; ++k) {
+            size_t victim = (w->index + k)%n->workers_count;
+            size_t i;
+            while ((i = atomic_fetch_add(&n->cursors[victim], NRUN_CHUNK)) < n->ends[victim]) {
+                size_t end = i + NRUN_CHUNK < n->ends[victim] ? i + NRUN_CHUNK : n->ends[victim];
+                for (; i < end; ++i) {
+                    Config *config = n->frontier.data[i];
+                    nrun_expand(n, config, w->index);
+                    shared_tape_release(config->tape);
+                    config->tape = NULL;
+                }
+            }
+        }
+
+        pthread_barrier_wait(&n->finish);
+    }
+    return NULL;
+}
+
+static void print_nrun_path(const Nrun *n, const Config *config)
+{
+    Configs path = {0};
+    for (; config->parent != NULL; config = config->parent) da_append(&path, (Config*) config);
+
+    const Machine *m = n->m;
+    for (size_t i = path.count; i-- > 0;) {
+        const Config *it = path.data[i];
+        printf("    "SV_Fmt" "SV_Fmt" "SV_Fmt" %s "SV_Fmt"\n",
+               SV_Arg(m->states.data[it->parent->state]),
+               SV_Arg(m->alphabet.data[it->read]),
+               SV_Arg(m->alphabet.data[it->via.write]),
+               it->via.step < 0 ? "<-" : "->",
+               SV_Arg(m->states.data[it->state]));
+    }
+    free(path.data);
+}
+
+// Searches for the shortest path from the initial configuration of the run to its `accept` state
+// that is at most `max_depth` steps long
+void nrun_search(Nrun *n, const Machine *m, const Run *run, size_t max_depth)
+{
+    *n = (Nrun) { .m = m };
+    symbols_find(&m->alphabet, run->init.text, &n->init);
+    symbols_find(&m->states, run->accept.text, &n->accept);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n->workers_count = cpus > 0 ? (size_t) cpus : 1;
+    n->cursors = calloc(n->workers_count, sizeof(*n->cursors));
+    n->ends = calloc(n->workers_count, sizeof(*n->ends));
+    n->next = calloc(n->workers_count, sizeof(*n->next));
+    n->allocated = calloc(n->workers_count, sizeof(*n->allocated));
+    n->visited_capacity = NRUN_MAX_CONFIGS*2;
+    n->visited = calloc(n->visited_capacity, sizeof(*n->visited));
+    assert(n->visited != NULL && "Buy more RAM lol");
+
+    Config *root = malloc(sizeof(*root));
+    assert(root != NULL && "Buy more RAM lol");
+    *root = (Config) {0};
+    symbols_find(&m->states, run->state.text, &root->state);
+    Cells initial = {0};
+    run_initial_tape(m, run, &initial);
+    root->tape = shared_tape_alloc(initial.count);
+    for (size_t i = 0; i < initial.count; ++i) {
+        root->tape->cells[i] = initial.data[i];
+        root->tape_hash ^= cell_hash(n, i, root->tape->cells[i]);
+    }
+    free(initial.data);
+    visited_insert(n, config_hash(root->tape_hash, root->state, root->head));
+    atomic_init(&n->explored, 1);
+    da_append(&n->allocated[0], root);
+    n->root = root;
+
+    if (root->state == n->accept) {
+        atomic_store(&n->found, root);
+        shared_tape_release(root->tape);
+    } else {
+        da_append(&n->frontier, root);
+    }
+
+    pthread_barrier_init(&n->start, NULL, n->workers_count + 1);
+    pthread_barrier_init(&n->finish, NULL, n->workers_count + 1);
+    pthread_t *threads = calloc(n->workers_count, sizeof(*threads));
+    Nrun_Worker *workers = calloc(n->workers_count, sizeof(*workers));
+    for (size_t i = 0; i < n->workers_count; ++i) {
+        workers[i] = (Nrun_Worker) { .n = n, .index = i };
+        pthread_create(&threads[i], NULL, nrun_worker, &workers[i]);
+    }
+
+    while (n->frontier.count > 0 && n->depth < max_depth && atomic_load(&n->found) == NULL && atomic_load(&n->explored) < NRUN_MAX_CONFIGS) {
+        size_t share = (n->frontier.count + n->workers_count - 1)/n->workers_count;
+        for (size_t i = 0; i < n->workers_count; ++i) {
+            size_t begin = i*share < n->frontier.count ? i*share : n->frontier.count;
+            atomic_store(&n->cursors[i], begin);
+            n->ends[i] = begin + share < n->frontier.count ? begin + share : n->frontier.count;
+        }
+
+        pthread_barrier_wait(&n->start);
+        pthread_barrier_wait(&n->finish);
+
+        n->frontier.count = 0;
+        for (size_t i = 0; i < n->workers_count; ++i) {
+            da_append_many(&n->frontier, n->next[i].data, n->next[i].count);
+            n->next[i].count = 0;
+        }
+        n->depth += 1;
+    }
+
+    n->done = true;
+    pthread_barrier_wait(&n->start);
+    for (size_t i = 0; i < n->workers_count; ++i) pthread_join(threads[i], NULL);
+    pthread_barrier_destroy(&n->start);
+    pthread_barrier_destroy(&n->finish);
+    free(threads);
+    free(workers);
+}
+
+void nrun_free(Nrun *n)
+{
+    for (size_t i = 0; i < n->frontier.count; ++i) shared_tape_release(n->frontier.data[i]->tape);
+    for (size_t i = 0; i < n->workers_count; ++i) {
+        for (size_t j = 0; j < n->allocated[i].count; ++j) free(n->allocated[i].data[j]);
+        free(n->allocated[i].data);
+        free(n->next[i].data);
+    }
+    free(n->frontier.data);
+    free(n->cursors);
+    free(n->ends);
+    free(n->next);
+    free(n->allocated);
+    free((void*) n->visited);
+}
+
+void execute_nrun(Run *run, Machine *m, const Top_Level *tl)
+{
+    printf(Loc_Fmt": #nrun\n", Loc_Arg(run->loc));
+    machine_compile_alternatives(m, tl);
+
+    Nrun n;
+    nrun_search(&n, m, run, SIZE_MAX);
+    run_unmap_file(run);
+
+    Config *found = atomic_load(&n.found);
+    size_t explored = atomic_load(&n.explored);
+    String_View accept = run->accept.text;
+    if (found != NULL) {
+        printf(SV_Fmt" is reachable in %zu steps (explored %zu configurations)\n", SV_Arg(accept), found == n.root ? 0 : n.depth, explored);
+        print_nrun_path(&n, found);
+    } else if (n.frontier.count == 0) {
+        printf(SV_Fmt" is not reachable (explored %zu configurations)\n", SV_Arg(accept), explored);
+    } else {
+        printf(SV_Fmt" was not reached within %zu steps. Gave up after exploring %zu configurations\n", SV_Arg(accept), n.depth, explored);
+    }
+    nrun_free(&n);
+
+    printf("-- HALT --\n");
+}
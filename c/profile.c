@@ -0,0 +1,167 @@
+// # Profile
+//
+// `--profile-out` counts how many steps every (state, symbol) of the transition table took and
+// saves the counts as text, one `State Symbol Count` per line, hottest first. `--profile-in`
+// feeds them back into the next compilation: the states and the symbols are renumbered by how
+// hot they are, so the rows of the hot states sit next to each other at the beginning of the
+// table and the hot symbols come first within every row. The real workloads then touch as few
+// cache lines of the table as possible.
+
+typedef struct {
+    Symbol_Id state;
+    Symbol_Id read;
+    uint64_t count;
+} Profile_Entry;
+
+static int profile_entry_compare(const void *a, const void *b)
+{
+    const Profile_Entry *x = a;
+    const Profile_Entry *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    if (x->state != y->state) return x->state < y->state ? -1 : 1;
+    return x->read < y->read ? -1 : x->read > y->read;
+}
+
+bool profile_save(const char *path, const Machine *m, const uint64_t *counts)
+{
+    size_t entries_count = 0;
+    Profile_Entry *entries = malloc(m->slots_count*sizeof(*entries));
+    assert((entries != NULL || m->slots_count == 0) && "Buy more RAM lol");
+    for (size_t slot = 0; slot < m->slots_count; ++slot) {
+        Symbol_Id state, read;
+        if (counts[slot] > 0 && machine_slot_pair(m, slot, &state, &read)) {
+            entries[entries_count++] = (Profile_Entry) { state, read, counts[slot] };
+        }
+    }
+    qsort(entries, entries_count, sizeof(*entries), profile_entry_compare);
+
+    String_Builder sb = {0};
+    for (size_t i = 0; i < entries_count; ++i) {
+        char count[32];
+        sb_append_symbol(&sb, m->states.data[entries[i].state]);
+        sb_append_cstr(&sb, " ");
+        sb_append_symbol(&sb, m->alphabet.data[entries[i].read]);
+        snprintf(count, sizeof(count), " %"PRIu64"\n", entries[i].count);
+        sb_append_cstr(&sb, count);
+    }
+    free(entries);
+
+    FILE *f = fopen(path, "wb");
+    bool result = f != NULL && fwrite(sb.data, 1, sb.count, f) == sb.count;
+    if (f) result = fclose(f) == 0 && result;
+    if (!result) printf("ERROR: could not write profile %s: %s\n", path, strerror(errno));
+    free(sb.data);
+    return result;
+}
+
+typedef struct {
+    Symbol_Id id;
+    uint64_t count;
+} Profile_Rank;
+
+static int profile_rank_compare(const void *a, const void *b)
+{
+    const Profile_Rank *x = a;
+    const Profile_Rank *y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    // The cold ones keep their original order
+    return x->id < y->id ? -1 : x->id > y->id;
+}
+
+// Interns the symbols in the order of the ranks and returns the new id of every old one
+static Symbol_Id *profile_renumber(Symbols *symbols, Profile_Rank *ranks)
+{
+    qsort(ranks, symbols->count, sizeof(*ranks), profile_rank_compare);
+    Symbols renumbered = {0};
+    Symbol_Id *ids = malloc(symbols->count*sizeof(*ids));
+    assert(ids != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < symbols->count; ++i) {
+        ids[ranks[i].id] = symbols_intern(&renumbered, symbols->data[ranks[i].id]);
+    }
+    free(symbols->data);
+    free(symbols->buckets);
+    *symbols = renumbered;
+    return ids;
+}
+
+// Renumbers the states and the symbols of the compiled Machine in the order of the ranks, the
+// highest count first, and lays the transition table out accordingly. The ranks are indexed by
+// the old ids and get sorted in place.
+void machine_renumber(Machine *m, Profile_Rank *states, Profile_Rank *symbols)
+{
+    // The pairs are decoded with the old numbering, which has the same amount of the symbols
+    Machine old = *m;
+    Symbol_Id *state_ids = profile_renumber(&m->states, states);
+    Symbol_Id *symbol_ids = profile_renumber(&m->alphabet, symbols);
+
+    m->table = calloc(m->slots_count, sizeof(*m->table));
+    assert((m->table != NULL || m->slots_count == 0) && "Buy more RAM lol");
+    if (old.keys != NULL) {
+        m->keys = calloc(m->slots_count, sizeof(*m->keys));
+        assert(m->keys != NULL && "Buy more RAM lol");
+    }
+    for (size_t slot = 0; slot < old.slots_count; ++slot) {
+        Symbol_Id state, read;
+        if (!machine_slot_pair(&old, slot, &state, &read)) continue;
+        Transition t = old.table[slot];
+        if (t.flags&TF_DEFINED) {
+            t.write = symbol_ids[t.write];
+            t.next = state_ids[t.next];
+        }
+        m->table[machine_slot_insert(m, state_ids[state], symbol_ids[read])] = t;
+    }
+    free(old.table);
+    free(old.keys);
+    machine_compile_narrow(m, machine_cell_bits(m));
+
+    free(state_ids);
+    free(symbol_ids);
+}
+
+// Renumbers the states and the symbols of the compiled Machine by their counts in the profile.
+// The names in the profile that the Machine does not know about are ignored, so a profile of an
+// older version of the program is still useful.
+bool profile_apply(const char *path, Machine *m)
+{
+    bool result = true;
+    String_Builder content = {0};
+    Profile_Rank *states = calloc(m->states.count, sizeof(*states));
+    Profile_Rank *symbols = calloc(m->alphabet.count, sizeof(*symbols));
+    assert(states != NULL && symbols != NULL && "Buy more RAM lol");
+    for (Symbol_Id id = 0; id < m->states.count; ++id) states[id].id = id;
+    for (Symbol_Id id = 0; id < m->alphabet.count; ++id) symbols[id].id = id;
+
+    Errno err = read_entire_file(path, &content);
+    if (err != 0) {
+        printf("ERROR: could not read profile %s: %s\n", path, strerror(err));
+        return_defer(false);
+    }
+
+    Lexer l = lexer_from_string(sb_to_sv(content), sv_from_cstr(path));
+    Token state;
+    while (lexer_peek(&l, &state) == LR_VALID) {
+        Token read, count;
+        if (!lexer_expect_token_(&l, &state, MASK(TK_SYMBOL))) return_defer(false);
+        if (!lexer_expect_token_(&l, &read, MASK(TK_SYMBOL))) return_defer(false);
+        if (!lexer_expect_token_(&l, &count, MASK(TK_SYMBOL))) return_defer(false);
+        for (size_t i = 0; i < count.text.count; ++i) {
+            if (!isdigit(count.text.data[i])) {
+                printf(Loc_Fmt": ERROR: count must be a non-negative integer, but got "SV_Fmt"\n", Loc_Arg(count.loc), SV_Arg(count.text));
+                return_defer(false);
+            }
+        }
+
+        uint64_t n = sv_to_u64(count.text);
+        Symbol_Id id;
+        if (symbols_find(&m->states, state.text, &id)) states[id].count += n;
+        if (symbols_find(&m->alphabet, read.text, &id)) symbols[id].count += n;
+    }
+
+    machine_renumber(m, states, symbols);
+
+defer:
+    free(content.data);
+    free(states);
+    free(symbols);
+    return result;
+}
@@ -0,0 +1,524 @@
+// # Server
+//
+// `turj serve` keeps the compiled programs in memory, so the jobs that run the same program
+// over and over do not pay for starting the process, reading, parsing and compiling it every
+// time. The requests are read line by line from stdin or from the clients of a UNIX domain
+// socket and executed by a pool of workers. Every request starts with a tag chosen by the
+// client. The response carries the same tag, since the responses come in the order the
+// requests finish rather than the order they were sent in.
+//
+//     <tag> load <path>                        -> <tag> ok <program>
+//     <tag> source <size>\n<size bytes>        -> <tag> ok <program>
+//     <tag> run <program> <limit> <State> <Tape> -> <tag> <status> <steps> <State> <head> <Tape>
+//     anything that goes wrong                 -> <tag> error <message>
+//
+// <program> is the hash of the source of the program. The same source is compiled only once.
+// Since the runs name the program by nothing but the hash, a source whose hash collides with
+// a different program that is already loaded is refused rather than shadowed.
+// <limit> is the maximum amount of steps. 0 and anything above the --max-steps of the server
+// mean --max-steps, so no request can keep a worker busy forever. The Tapes are tape literals
+// as in `#run` and <status> is one of `halt`, `underflow` or `limit`. The breakpoints of the
+// program are ignored. The diagnostics of the compiler go to stderr when serving on stdin.
+
+typedef struct {
+    uint64_t hash;
+    // The tokens of the program point into the source
+    String_Builder source;
+    char *path;
+    Top_Level tl;
+    Machine m;
+} Program;
+
+typedef struct {
+    Program **data;
+    size_t count;
+    size_t capacity;
+} Programs;
+
+typedef struct {
+    FILE *in;
+    int out;
+    // Serializes the responses of the workers
+    pthread_mutex_t lock;
+    atomic_size_t refs;
+} Connection;
+
+typedef struct Job Job;
+
+struct Job {
+    Job *next;
+    Connection *conn;
+    // NULL tells the worker to stop
+    char *line;
+    String_Builder payload;
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Job *first;
+    Job *last;
+
+    pthread_mutex_t programs_lock;
+    Programs programs;
+    // The limit of every run. 0 means no limit.
+    uint64_t max_steps;
+} Server;
+
+static Connection *connection_new(FILE *in, int out)
+{
+    Connection *conn = malloc(sizeof(*conn));
+    assert(conn != NULL && "Buy more RAM lol");
+    conn->in = in;
+    conn->out = out;
+    pthread_mutex_init(&conn->lock, NULL);
+    atomic_init(&conn->refs, 1);
+    return conn;
+}
+
+static void connection_release(Connection *conn)
+{
+    if (atomic_fetch_sub(&conn->refs, 1) != 1) return;
+    // The socket is closed along with its stream
+    if (conn->in != stdin) fclose(conn->in);
+    pthread_mutex_destroy(&conn->lock);
+    free(conn);
+}
+
+static void server_push(Server *s, Job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&s->lock);
+    if (s->last) s->last->next = job; else s->first = job;
+    s->last = job;
+    pthread_cond_signal(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+}
+
+static Job *server_pop(Server *s)
+{
+    pthread_mutex_lock(&s->lock);
+    while (s->first == NULL) pthread_cond_wait(&s->ready, &s->lock);
+    Job *job = s->first;
+    s->first = job->next;
+    if (s->first == NULL) s->last = NULL;
+    pthread_mutex_unlock(&s->lock);
+    return job;
+}
+
+static void serve_respond(Connection *conn, String_View tag, const String_Builder *sb)
+{
+    pthread_mutex_lock(&conn->lock);
+    String_View parts[] = { tag, SV(" "), sb_to_sv(*sb), SV("\n") };
+    for (size_t i = 0; i < sizeof(parts)/sizeof(parts[0]); ++i) {
+        size_t written = 0;
+        while (written < parts[i].count) {
+            ssize_t n = write(conn->out, parts[i].data + written, parts[i].count - written);
+            if (n < 0 && errno == EINTR) continue;
+            // The client is gone. Nothing to respond to.
+            if (n < 0) goto done;
+            written += n;
+        }
+    }
+done:
+    pthread_mutex_unlock(&conn->lock);
+}
+
+static void serve_error(Connection *conn, String_View tag, const char *message)
+{
+    String_Builder sb = {0};
+    sb_append_cstr(&sb, "error ");
+    sb_append_cstr(&sb, message);
+    serve_respond(conn, tag, &sb);
+    free(sb.data);
+}
+
+// Appends the tape as a `#run` tape literal, so it can be fed right back in another request
+static void serve_append_tape(String_Builder *sb, const Exec *e)
+{
+    sb_append_cstr(sb, "[");
+    for (size_t i = 0; i < e->tape.count;) {
+        size_t j = i + 1;
+        while (j < e->tape.count && e->tape.data[j] == e->tape.data[i]) j += 1;
+        if (i > 0) sb_append_cstr(sb, " ");
+        sb_append_symbol(sb, e->m->alphabet.data[e->tape.data[i]]);
+        if (j - i > 1) {
+            char count[32];
+            snprintf(count, sizeof(count), "*%zu", j - i);
+            sb_append_cstr(sb, count);
+        }
+        i = j;
+    }
+    // The last symbol of the literal is what the rest of the tape is filled with
+    if (e->tape.count == 0 || e->tape.data[e->tape.count - 1] != e->init) {
+        if (e->tape.count > 0) sb_append_cstr(sb, " ");
+        sb_append_symbol(sb, e->m->alphabet.data[e->init]);
+    }
+    sb_append_cstr(sb, "]");
+}
+
+// Must be called with the programs_lock held. There is at most one program per hash.
+static Program *serve_lookup(Server *s, uint64_t hash)
+{
+    for (size_t i = 0; i < s->programs.count; ++i) {
+        if (s->programs.data[i]->hash == hash) return s->programs.data[i];
+    }
+    return NULL;
+}
+
+static void program_free(Program *program)
+{
+    top_level_free(&program->tl);
+    machine_free(&program->m);
+    free(program->source.data);
+    free(program->path);
+    free(program);
+}
+
+#define SERVE_COLLISION_ERROR "a different program with the same hash is already loaded"
+
+// Returns the program with the same source, compiling it if it's not in the cache yet. Takes
+// the ownership of the source. Returns NULL and sets the `error` if there is no such program.
+static Program *serve_program(Server *s, String_Builder source, const char *path, const char **error)
+{
+    uint64_t hash = sv_hash(sb_to_sv(source));
+
+    pthread_mutex_lock(&s->programs_lock);
+    Program *existing = serve_lookup(s, hash);
+    pthread_mutex_unlock(&s->programs_lock);
+    if (existing) {
+        bool same = sv_eq(sb_to_sv(existing->source), sb_to_sv(source));
+        free(source.data);
+        if (!same) *error = SERVE_COLLISION_ERROR;
+        return same ? existing : NULL;
+    }
+
+    // Compiling outside of the lock lets the other workers keep going. If somebody compiles
+    // the same program in the meantime, theirs is kept.
+    Program *program = calloc(1, sizeof(*program));
+    assert(program != NULL && "Buy more RAM lol");
+    program->hash = hash;
+    program->source = source;
+    program->path = strdup(path);
+    bool ok = parse_program(&program->tl, sb_to_sv(program->source), sv_from_cstr(program->path))
+        && machine_compile(&program->m, &program->tl);
+    if (!ok) *error = "could not compile the program";
+
+    pthread_mutex_lock(&s->programs_lock);
+    existing = serve_lookup(s, hash);
+    if (ok && existing == NULL) da_append(&s->programs, program);
+    pthread_mutex_unlock(&s->programs_lock);
+
+    if (ok && existing == NULL) return program;
+    bool same = existing != NULL && sv_eq(sb_to_sv(existing->source), sb_to_sv(program->source));
+    if (existing != NULL && !same) *error = SERVE_COLLISION_ERROR;
+    program_free(program);
+    return same ? existing : NULL;
+}
+
+static Program *serve_find_program(Server *s, uint64_t hash)
+{
+    pthread_mutex_lock(&s->programs_lock);
+    Program *result = serve_lookup(s, hash);
+    pthread_mutex_unlock(&s->programs_lock);
+    return result;
+}
+
+static void serve_loaded(Connection *conn, String_View tag, const Program *program, const char *error)
+{
+    if (program == NULL) {
+        serve_error(conn, tag, error);
+        return;
+    }
+    String_Builder sb = {0};
+    char id[32];
+    snprintf(id, sizeof(id), "ok %016"PRIx64, program->hash);
+    sb_append_cstr(&sb, id);
+    serve_respond(conn, tag, &sb);
+    free(sb.data);
+}
+
+static void serve_run(Server *s, Connection *conn, String_View tag, String_View args)
+{
+    args = sv_trim_left(args);
+    String_View id = sv_chop_by_delim(&args, ' ');
+    args = sv_trim_left(args);
+    String_View limit_text = sv_chop_by_delim(&args, ' ');
+
+    char id_cstr[32];
+    snprintf(id_cstr, sizeof(id_cstr), SV_Fmt, SV_Arg(id));
+    Program *program = serve_find_program(s, strtoull(id_cstr, NULL, 16));
+    if (program == NULL) {
+        serve_error(conn, tag, "unknown program");
+        return;
+    }
+    uint64_t limit = sv_to_u64(limit_text);
+    if (limit == 0 || (s->max_steps > 0 && limit > s->max_steps)) limit = s->max_steps;
+    if (limit == 0) limit = UINT64_MAX;
+
+    Run run = {0};
+    Lexer l = lexer_from_string(args, SV("request"));
+    Token bracket;
+    if (!lexer_expect_token_(&l, &run.state, MASK(TK_SYMBOL))
+        || !lexer_expect_token_(&l, &bracket, MASK(TK_OBRACKET))
+        || !parse_tape(&l, &run.tape)) {
+        serve_error(conn, tag, "could not parse the run");
+        goto defer;
+    }
+    if (run.tape.count == 0) {
+        serve_error(conn, tag, "tape may not be empty");
+        goto defer;
+    }
+    run.init = run.tape.data[run.tape.count - 1].symbol;
+
+    // The compiled Machine is shared by the workers, so the run may only use the symbols it
+    // already knows about
+    const Machine *m = &program->m;
+    if (!symbols_find(&m->states, run.state.text, NULL)) {
+        serve_error(conn, tag, "unknown state");
+        goto defer;
+    }
+    for (size_t i = 0; i < run.tape.count; ++i) {
+        if (run.tape.data[i].group == 0 && !symbols_find(&m->alphabet, run.tape.data[i].symbol.text, NULL)) {
+            serve_error(conn, tag, "unknown symbol");
+            goto defer;
+        }
+    }
+
+    Exec e;
+    exec_from_run(m, &run, NULL, &e);
+    Exec_Status status;
+    while ((status = exec_run(&e, limit, NULL)) == EXEC_BREAK) {
+        status = exec_step(&e);
+        if (status != EXEC_OK) break;
+    }
+    exec_ensure_head(&e);
+    exec_widen(&e);
+
+    String_Builder sb = {0};
+    char numbers[64];
+    sb_append_cstr(&sb, status == EXEC_LIMIT ? "limit" : status == EXEC_UNDERFLOW ? "underflow" : "halt");
+    snprintf(numbers, sizeof(numbers), " %"PRIu64" ", e.steps);
+    sb_append_cstr(&sb, numbers);
+    sb_append_symbol(&sb, m->states.data[e.state]);
+    snprintf(numbers, sizeof(numbers), " %zu ", e.head);
+    sb_append_cstr(&sb, numbers);
+    serve_append_tape(&sb, &e);
+    serve_respond(conn, tag, &sb);
+    free(sb.data);
+    exec_free(&e);
+
+defer:
+    free(run.tape.data);
+}
+
+static void serve_job(Server *s, Job *job)
+{
+    String_View line = sv_trim(sv_from_cstr(job->line));
+    String_View tag = sv_chop_by_delim(&line, ' ');
+    line = sv_trim_left(line);
+    String_View command = sv_chop_by_delim(&line, ' ');
+
+    if (sv_eq(command, SV("load"))) {
+        String_Builder path = {0};
+        String_View path_sv = sv_trim(line);
+        sb_append_buf(&path, path_sv.data, path_sv.count);
+        sb_append_null(&path);
+
+        String_Builder source = {0};
+        Errno err = read_entire_file(path.data, &source);
+        if (err != 0) {
+            serve_error(job->conn, tag, strerror(err));
+            free(source.data);
+        } else {
+            const char *error = NULL;
+            Program *program = serve_program(s, source, path.data, &error);
+            serve_loaded(job->conn, tag, program, error);
+        }
+        free(path.data);
+    } else if (sv_eq(command, SV("source"))) {
+        String_Builder source = job->payload;
+        job->payload = (String_Builder) {0};
+        const char *error = NULL;
+        Program *program = serve_program(s, source, "source", &error);
+        serve_loaded(job->conn, tag, program, error);
+    } else if (sv_eq(command, SV("run"))) {
+        serve_run(s, job->conn, tag, line);
+    } else {
+        serve_error(job->conn, tag, "unknown command");
+    }
+}
+
+static void *serve_worker(void *arg)
+{
+    Server *s = arg;
+    while (true) {
+        Job *job = server_pop(s);
+        if (job->line == NULL) {
+            free(job);
+            break;
+        }
+        serve_job(s, job);
+        connection_release(job->conn);
+        free(job->line);
+        free(job->payload.data);
+        free(job);
+    }
+    return NULL;
+}
+
+// Reads the requests of the connection until the end and hands them over to the workers
+static void serve_read(Server *s, Connection *conn)
+{
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t n;
+    while ((n = getline(&line, &capacity, conn->in)) >= 0) {
+        if (sv_trim(sv_from_cstr(line)).count == 0) continue;
+
+        Job *job = calloc(1, sizeof(*job));
+        assert(job != NULL && "Buy more RAM lol");
+        job->line = strdup(line);
+        job->conn = conn;
+
+        // The source of the program follows the request line as is
+        String_View request = sv_trim(sv_from_cstr(line));
+        sv_chop_by_delim(&request, ' ');
+        request = sv_trim_left(request);
+        if (sv_eq(sv_chop_by_delim(&request, ' '), SV("source"))) {
+            size_t size = sv_to_u64(sv_trim(request));
+            for (size_t i = 0; i < size; ++i) da_append(&job->payload, '\0');
+            if (size > 0 && fread(job->payload.data, size, 1, conn->in) != 1) {
+                free(job->payload.data);
+                free(job->line);
+                free(job);
+                break;
+            }
+        }
+
+        atomic_fetch_add(&conn->refs, 1);
+        server_push(s, job);
+    }
+    free(line);
+    connection_release(conn);
+}
+
+typedef struct {
+    Server *s;
+    Connection *conn;
+} Client;
+
+static void *serve_client(void *arg)
+{
+    Client client = *(Client*) arg;
+    free(arg);
+    serve_read(client.s, client.conn);
+    return NULL;
+}
+
+#define SERVE_MAX_THREADS 1024
+#define SERVE_DEFAULT_MAX_STEPS 1000000000
+
+static void serve_usage(const char *program_name)
+{
+    printf("Usage: %s serve [OPTIONS]\n", program_name);
+    printf("OPTIONS:\n");
+    printf("    --socket <path>     listen on the UNIX domain socket at <path> instead of stdin/stdout\n");
+    printf("    --threads <count>   amount of worker threads (default: amount of cores)\n");
+    printf("    --max-steps <n>     the most steps a run may take, 0 means no limit (default: %"PRIu64")\n", (uint64_t) SERVE_DEFAULT_MAX_STEPS);
+}
+
+int serve_main(const char *program_name, int argc, char **argv)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t threads_count = cpus > 0 ? (size_t) cpus : 1;
+    const char *socket_path = NULL;
+    uint64_t max_steps = SERVE_DEFAULT_MAX_STEPS;
+
+    while (argc > 0) {
+        const char *flag = shift_args(&argc, &argv);
+        if (argc == 0) {
+            serve_usage(program_name);
+            printf("ERROR: no value was provided for %s\n", flag);
+            return 1;
+        }
+        const char *value = shift_args(&argc, &argv);
+        if (strcmp(flag, "--socket") == 0) {
+            socket_path = value;
+        } else if (strcmp(flag, "--threads") == 0) {
+            uint64_t count;
+            if (!parse_count_flag(flag, value, &count)) return 1;
+            if (count < 1 || count > SERVE_MAX_THREADS) {
+                printf("ERROR: %s must be within 1..%d\n", flag, SERVE_MAX_THREADS);
+                return 1;
+            }
+            threads_count = count;
+        } else if (strcmp(flag, "--max-steps") == 0) {
+            if (!parse_count_flag(flag, value, &max_steps)) return 1;
+        } else {
+            serve_usage(program_name);
+            printf("ERROR: unknown flag %s\n", flag);
+            return 1;
+        }
+    }
+
+    // A client that hangs up early must not take the server down with it
+    signal(SIGPIPE, SIG_IGN);
+    // The log is shared by all the workers and the clients
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    Server s = { .max_steps = max_steps };
+    pthread_mutex_init(&s.lock, NULL);
+    pthread_cond_init(&s.ready, NULL);
+    pthread_mutex_init(&s.programs_lock, NULL);
+
+    pthread_t *threads = calloc(threads_count, sizeof(*threads));
+    assert(threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < threads_count; ++i) pthread_create(&threads[i], NULL, serve_worker, &s);
+
+    if (socket_path == NULL) {
+        // stdout belongs to the protocol now. Everything else that is printed goes to stderr.
+        int out = dup(STDOUT_FILENO);
+        fflush(stdout);
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        serve_read(&s, connection_new(stdin, out));
+
+        // The workers finish the pending requests before they get to these
+        for (size_t i = 0; i < threads_count; ++i) server_push(&s, calloc(1, sizeof(Job)));
+        for (size_t i = 0; i < threads_count; ++i) pthread_join(threads[i], NULL);
+        close(out);
+        return 0;
+    }
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+        printf("ERROR: socket path %s is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+    unlink(socket_path);
+
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0 || bind(server, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(server, 64) < 0) {
+        printf("ERROR: could not listen on %s: %s\n", socket_path, strerror(errno));
+        return 1;
+    }
+    printf("Listening on %s with %zu workers\n", socket_path, threads_count);
+
+    while (true) {
+        int client = accept(server, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR) continue;
+            printf("ERROR: could not accept a connection: %s\n", strerror(errno));
+            return 1;
+        }
+
+        Client *arg = malloc(sizeof(*arg));
+        assert(arg != NULL && "Buy more RAM lol");
+        arg->s = &s;
+        arg->conn = connection_new(fdopen(client, "r"), client);
+        pthread_t thread;
+        pthread_create(&thread, NULL, serve_client, arg);
+        pthread_detach(thread);
+    }
+}
@@ -0,0 +1,133 @@
+// # Tape Statistics
+//
+// `--tape-stats <path>` records how every `#run` uses its tape and saves it as JSON for
+// plotting: the histogram of the head positions, the histogram of the lengths of the sweeps
+// between the reversals of the head and the size of the tape over time.
+
+typedef struct {
+    Loc loc;
+    size_t initial_tape_count;
+    // The final configuration
+    uint64_t steps;
+    size_t tape_count;
+    Tape_Stats stats;
+} Run_Stats;
+
+typedef struct {
+    Run_Stats *data;
+    size_t count;
+    size_t capacity;
+} Runs_Stats;
+
+static void sb_append_u64(String_Builder *sb, uint64_t x)
+{
+    char buffer[32];
+    snprintf(buffer, sizeof(buffer), "%"PRIu64, x);
+    sb_append_cstr(sb, buffer);
+}
+
+static void sb_append_json_string(String_Builder *sb, String_View sv)
+{
+    sb_append_cstr(sb, "\"");
+    for (size_t i = 0; i < sv.count; ++i) {
+        char x = sv.data[i];
+        if (x == '"' || x == '\\') {
+            da_append(sb, '\\');
+            da_append(sb, x);
+        } else if ((unsigned char) x < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", (unsigned char) x);
+            sb_append_cstr(sb, escape);
+        } else {
+            da_append(sb, x);
+        }
+    }
+    sb_append_cstr(sb, "\"");
+}
+
+static void sb_append_json_array(String_Builder *sb, const uint64_t *xs, size_t count)
+{
+    sb_append_cstr(sb, "[");
+    for (size_t i = 0; i < count; ++i) {
+        if (i > 0) sb_append_cstr(sb, ",");
+        sb_append_u64(sb, xs[i]);
+    }
+    sb_append_cstr(sb, "]");
+}
+
+static void run_stats_append_json(String_Builder *sb, const Run_Stats *run)
+{
+    const Tape_Stats *s = &run->stats;
+    char loc[512];
+    snprintf(loc, sizeof(loc), Loc_Fmt, Loc_Arg(run->loc));
+
+    sb_append_cstr(sb, "{\"run\":");
+    sb_append_json_string(sb, sv_from_cstr(loc));
+    sb_append_cstr(sb, ",\"steps\":");
+    sb_append_u64(sb, run->steps);
+    sb_append_cstr(sb, ",\"cells_visited\":");
+    sb_append_u64(sb, s->cells);
+
+    // The width of the buckets is a power of two, so the boundaries are round numbers
+    size_t width = (size_t) 1<<s->shift;
+    sb_append_cstr(sb, ",\"head_histogram\":{\"bucket_width\":");
+    sb_append_u64(sb, width);
+    sb_append_cstr(sb, ",\"counts\":");
+    sb_append_json_array(sb, s->visits, (s->cells + width - 1)/width);
+    sb_append_cstr(sb, "}");
+
+    // The last sweep is still going when the Machine halts
+    Tape_Stats sweeps = *s;
+    if (sweeps.sweep > 0) tape_stats_sweep(&sweeps, sweeps.sweep);
+    size_t bins = TAPE_STATS_SWEEP_BINS;
+    while (bins > 0 && sweeps.sweeps[bins - 1] == 0) bins -= 1;
+    sb_append_cstr(sb, ",\"sweeps\":{\"count\":");
+    sb_append_u64(sb, sweeps.sweeps_count);
+    sb_append_cstr(sb, ",\"min\":");
+    sb_append_u64(sb, sweeps.sweeps_min);
+    sb_append_cstr(sb, ",\"max\":");
+    sb_append_u64(sb, sweeps.sweeps_max);
+    sb_append_cstr(sb, ",\"sum\":");
+    sb_append_u64(sb, sweeps.sweeps_sum);
+    sb_append_cstr(sb, ",\"log2_histogram\":");
+    sb_append_json_array(sb, sweeps.sweeps, bins);
+    sb_append_cstr(sb, "}");
+
+    sb_append_cstr(sb, ",\"growth\":[[0,");
+    sb_append_u64(sb, run->initial_tape_count);
+    sb_append_cstr(sb, "]");
+    for (size_t i = 0; i + 1 < s->growth.count; i += 2) {
+        sb_append_cstr(sb, ",");
+        sb_append_json_array(sb, &s->growth.data[i], 2);
+    }
+    if (s->growth.count == 0 || s->growth.data[s->growth.count - 2] != run->steps) {
+        uint64_t last[] = { run->steps, run->tape_count };
+        sb_append_cstr(sb, ",");
+        sb_append_json_array(sb, last, 2);
+    }
+    sb_append_cstr(sb, "]}");
+}
+
+bool runs_stats_save(const char *path, const Runs_Stats *runs)
+{
+    String_Builder sb = {0};
+    sb_append_cstr(&sb, "[\n");
+    for (size_t i = 0; i < runs->count; ++i) {
+        run_stats_append_json(&sb, &runs->data[i]);
+        sb_append_cstr(&sb, i + 1 < runs->count ? ",\n" : "\n");
+    }
+    sb_append_cstr(&sb, "]\n");
+
+    FILE *f = fopen(path, "wb");
+    bool result = f != NULL && fwrite(sb.data, 1, sb.count, f) == sb.count;
+    if (f) result = fclose(f) == 0 && result;
+    if (!result) printf("ERROR: could not write tape statistics %s: %s\n", path, strerror(errno));
+    free(sb.data);
+    return result;
+}
+
+void runs_stats_free(Runs_Stats *runs)
+{
+    for (size_t i = 0; i < runs->count; ++i) free(runs->data[i].stats.growth.data);
+    free(runs->data);
+}
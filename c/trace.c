@@ -0,0 +1,360 @@
+// # Trace
+//
+// The full trace is rendered and written by a separate thread, so the simulation never waits
+// for stdio or the pipe. The simulation sends it the compact records of every step through a
+// lock-free single-producer single-consumer ring buffer. The writer replays them on its own copy
+// of the tape, renders the lines into a large buffer and writes it out in big chunks.
+
+#define TRACE_RING_CAPACITY (1<<16)
+#define TRACE_FLUSH_THRESHOLD (1<<20)
+
+typedef struct {
+    // Collapse the runs of the same symbol into `symbol*count` and drop the blank tail
+    bool rle;
+    // Show only `window` cells on each side of the head
+    bool windowed;
+    size_t window;
+} Trace_Format;
+
+// Which cells of the tape make it into the line. The blank tail starts at `content`, which only
+// has to be exact past the head.
+static void trace_bounds(const Trace_Format *fmt, size_t count, size_t content, size_t head, size_t *begin, size_t *end, size_t *last)
+{
+    *begin = 0;
+    *end = count;
+    if (fmt->rle) *end = content > head + 1 ? content : head + 1;
+    *last = *end;
+    if (fmt->windowed) {
+        if (head > fmt->window) *begin = head - fmt->window;
+        if (*end - head - 1 > fmt->window) *end = head + fmt->window + 1;
+    }
+}
+
+typedef struct {
+    String_Builder *sb;
+    size_t line_start;
+    size_t head_start;
+    size_t head_end;
+} Trace_Line;
+
+static void trace_line_begin(Trace_Line *line, String_Builder *sb, const Machine *m, Symbol_Id state, size_t begin)
+{
+    *line = (Trace_Line) { .sb = sb, .line_start = sb->count };
+    String_View name = m->states.data[state];
+    sb_append_buf(sb, name.data, name.count);
+    sb_append_cstr(sb, ":");
+    if (begin > 0) sb_append_cstr(sb, " ...");
+}
+
+// Appends `count` cells of `symbol`, collapsed into `symbol*count` if there is more than one
+static void trace_line_cells(Trace_Line *line, const Machine *m, Symbol_Id symbol, size_t count, bool head)
+{
+    String_Builder *sb = line->sb;
+    String_View it = m->alphabet.data[symbol];
+    if (head) line->head_start = sb->count - line->line_start + 1;
+    sb_append_cstr(sb, " ");
+    sb_append_buf(sb, it.data, it.count);
+    if (head) line->head_end = sb->count - line->line_start;
+    if (count > 1) {
+        char digits[32];
+        snprintf(digits, sizeof(digits), "*%zu", count);
+        sb_append_cstr(sb, digits);
+    }
+}
+
+static void trace_line_end(Trace_Line *line, size_t end, size_t last)
+{
+    String_Builder *sb = line->sb;
+    if (end < last) sb_append_cstr(sb, " ...");
+    sb_append_cstr(sb, "\n");
+    for (size_t i = 0; i < line->head_start; ++i) da_append(sb, ' ');
+    for (size_t i = line->head_start; i < line->head_end; ++i) da_append(sb, '^');
+    sb_append_cstr(sb, "\n");
+}
+
+// Appends the configuration and the line with the carets under the head
+void trace_render_line(String_Builder *sb, const Machine *m, const Cells *tape, Symbol_Id init, Symbol_Id state, size_t head, const Trace_Format *fmt)
+{
+    size_t content = tape->count;
+    if (fmt->rle) {
+        while (content > head + 1 && tape->data[content - 1] == init) content -= 1;
+    }
+    size_t begin, end, last;
+    trace_bounds(fmt, tape->count, content, head, &begin, &end, &last);
+
+    Trace_Line line;
+    trace_line_begin(&line, sb, m, state, begin);
+    for (size_t i = begin; i < end;) {
+        size_t j = i + 1;
+        // The head always gets a cell of its own, so the carets point at exactly one symbol
+        if (fmt->rle && i != head) {
+            size_t limit = i < head ? head : end;
+            while (j < limit && tape->data[j] == tape->data[i]) j += 1;
+        }
+        trace_line_cells(&line, m, tape->data[i], j - i, i == head);
+        i = j;
+    }
+    trace_line_end(&line, end, last);
+}
+
+// # Trace Runs
+//
+// With --trace-rle the writer keeps the tape as the list of its runs of the same symbol as well,
+// so rendering a line takes as long as the runs it shows rather than the whole tape, and the blank
+// tail is just the last run. A step changes a single cell, which splits and merges at most a
+// couple of runs. Neighbouring runs never have the same symbol.
+
+typedef struct {
+    // The run spans up to the start of the next one or the end of the tape
+    size_t start;
+    Symbol_Id symbol;
+} Trace_Run;
+
+typedef struct {
+    Trace_Run *data;
+    size_t count;
+    size_t capacity;
+    // The number of cells all the runs span
+    size_t cells;
+} Trace_Runs;
+
+static size_t trace_run_end(const Trace_Runs *runs, size_t r)
+{
+    return r + 1 < runs->count ? runs->data[r + 1].start : runs->cells;
+}
+
+// The index of the run the cell `i` belongs to
+static size_t trace_runs_find(const Trace_Runs *runs, size_t i)
+{
+    size_t lo = 0;
+    size_t hi = runs->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (runs->data[mid].start <= i) lo = mid; else hi = mid;
+    }
+    return lo;
+}
+
+static void trace_runs_insert(Trace_Runs *runs, size_t r, Trace_Run run)
+{
+    da_append(runs, run);
+    memmove(&runs->data[r + 1], &runs->data[r], (runs->count - r - 1)*sizeof(run));
+    runs->data[r] = run;
+}
+
+static void trace_runs_remove(Trace_Runs *runs, size_t r)
+{
+    memmove(&runs->data[r], &runs->data[r + 1], (runs->count - r - 1)*sizeof(*runs->data));
+    runs->count -= 1;
+}
+
+static void trace_runs_append(Trace_Runs *runs, Symbol_Id symbol, size_t count)
+{
+    if (count == 0) return;
+    if (runs->count == 0 || runs->data[runs->count - 1].symbol != symbol) {
+        da_append(runs, ((Trace_Run) { .start = runs->cells, .symbol = symbol }));
+    }
+    runs->cells += count;
+}
+
+static void trace_runs_set(Trace_Runs *runs, size_t i, Symbol_Id symbol)
+{
+    size_t r = trace_runs_find(runs, i);
+    Trace_Run old = runs->data[r];
+    if (old.symbol == symbol) return;
+
+    // Carve the cell out into a run of its own
+    if (i + 1 < trace_run_end(runs, r)) {
+        trace_runs_insert(runs, r + 1, (Trace_Run) { .start = i + 1, .symbol = old.symbol });
+    }
+    if (i > old.start) {
+        trace_runs_insert(runs, r + 1, (Trace_Run) { .start = i, .symbol = symbol });
+        r += 1;
+    } else {
+        runs->data[r].symbol = symbol;
+    }
+
+    // And glue it to the neighbours that have the same symbol
+    if (r + 1 < runs->count && runs->data[r + 1].symbol == symbol) trace_runs_remove(runs, r + 1);
+    if (r > 0 && runs->data[r - 1].symbol == symbol) trace_runs_remove(runs, r);
+}
+
+// The same as trace_render_line() with --trace-rle, but from the runs of the tape
+void trace_render_runs(String_Builder *sb, const Machine *m, const Trace_Runs *runs, Symbol_Id init, Symbol_Id state, size_t head, const Trace_Format *fmt)
+{
+    assert(fmt->rle);
+    size_t content = runs->cells;
+    const Trace_Run *tail = &runs->data[runs->count - 1];
+    if (tail->symbol == init) content = tail->start;
+    size_t begin, end, last;
+    trace_bounds(fmt, runs->cells, content, head, &begin, &end, &last);
+
+    Trace_Line line;
+    trace_line_begin(&line, sb, m, state, begin);
+    for (size_t r = trace_runs_find(runs, begin); r < runs->count && runs->data[r].start < end; ++r) {
+        Symbol_Id symbol = runs->data[r].symbol;
+        size_t a = runs->data[r].start > begin ? runs->data[r].start : begin;
+        size_t b = trace_run_end(runs, r) < end ? trace_run_end(runs, r) : end;
+        // The head always gets a cell of its own, so the carets point at exactly one symbol
+        if (a <= head && head < b) {
+            if (a < head) trace_line_cells(&line, m, symbol, head - a, false);
+            trace_line_cells(&line, m, symbol, 1, true);
+            a = head + 1;
+        }
+        if (a < b) trace_line_cells(&line, m, symbol, b - a, false);
+    }
+    trace_line_end(&line, end, last);
+}
+
+void print_trace_line(Exec *e, const Trace_Format *fmt)
+{
+    exec_widen(e);
+    String_Builder sb = {0};
+    trace_render_line(&sb, e->m, &e->tape, e->init, e->state, e->head, fmt);
+    fwrite(sb.data, 1, sb.count, stdout);
+    free(sb.data);
+}
+
+typedef struct {
+    Symbol_Id write;
+    Symbol_Id state;
+    int32_t delta;
+} Trace_Record;
+
+typedef struct {
+    const Machine *m;
+    const Trace_Format *fmt;
+
+    Trace_Record *records;
+    // Both only ever grow. The ring indices are taken modulo TRACE_RING_CAPACITY.
+    atomic_size_t produced;
+    atomic_size_t consumed;
+    atomic_bool done;
+
+    // The writer's own copy of the configuration. The runs are only kept with --trace-rle.
+    Cells tape;
+    Trace_Runs runs;
+    Symbol_Id init;
+    Symbol_Id state;
+    size_t head;
+
+    int fd;
+    String_Builder out;
+    bool failed;
+} Trace_Writer;
+
+static void trace_flush(Trace_Writer *tw)
+{
+    size_t written = 0;
+    while (!tw->failed && written < tw->out.count) {
+        ssize_t n = write(tw->fd, tw->out.data + written, tw->out.count - written);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            tw->failed = true;
+            break;
+        }
+        written += n;
+    }
+    tw->out.count = 0;
+}
+
+static void trace_render(Trace_Writer *tw)
+{
+    while (tw->head >= tw->tape.count) da_append(&tw->tape, tw->init);
+    if (tw->fmt->rle) {
+        trace_runs_append(&tw->runs, tw->init, tw->tape.count - tw->runs.cells);
+        trace_render_runs(&tw->out, tw->m, &tw->runs, tw->init, tw->state, tw->head, tw->fmt);
+    } else {
+        trace_render_line(&tw->out, tw->m, &tw->tape, tw->init, tw->state, tw->head, tw->fmt);
+    }
+    if (tw->out.count >= TRACE_FLUSH_THRESHOLD) trace_flush(tw);
+}
+
+static void *trace_writer(void *arg)
+{
+    Trace_Writer *tw = arg;
+    trace_render(tw);
+
+    size_t consumed = atomic_load_explicit(&tw->consumed, memory_order_relaxed);
+    while (true) {
+        size_t produced = atomic_load_explicit(&tw->produced, memory_order_acquire);
+        if (consumed == produced) {
+            if (atomic_load_explicit(&tw->done, memory_order_acquire)
+                && consumed == atomic_load_explicit(&tw->produced, memory_order_acquire)) break;
+            // Nothing to do, so let's not keep the core busy
+            if (tw->out.count > 0) trace_flush(tw); else sched_yield();
+            continue;
+        }
+
+        for (; consumed < produced; ++consumed) {
+            Trace_Record record = tw->records[consumed&(TRACE_RING_CAPACITY - 1)];
+            tw->tape.data[tw->head] = record.write;
+            if (tw->fmt->rle) trace_runs_set(&tw->runs, tw->head, record.write);
+            tw->state = record.state;
+            tw->head += record.delta;
+            trace_render(tw);
+        }
+        atomic_store_explicit(&tw->consumed, consumed, memory_order_release);
+    }
+
+    trace_flush(tw);
+    return NULL;
+}
+
+// Runs the Machine to the halt or until it performs `limit` steps in total, sending every
+// configuration to the trace writer thread, which writes them to `fd`
+Exec_Status trace_run(Exec *e, uint64_t limit, int fd, const Trace_Format *fmt)
+{
+    // Whatever stdio has buffered so far must come out before the trace
+    fflush(stdout);
+
+    Trace_Writer tw = {
+        .m = e->m,
+        .fmt = fmt,
+        .fd = fd,
+        .init = e->init,
+        .state = e->state,
+        .head = e->head,
+    };
+    // The Machine keeps running on its own cells, whatever their width
+    for (size_t i = 0; i < exec_tape_count(e); ++i) da_append(&tw.tape, exec_cell(e, i));
+    if (fmt->rle) {
+        for (size_t i = 0; i < tw.tape.count; ++i) trace_runs_append(&tw.runs, tw.tape.data[i], 1);
+    }
+    tw.records = malloc(TRACE_RING_CAPACITY*sizeof(*tw.records));
+    assert(tw.records != NULL && "Buy more RAM lol");
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, trace_writer, &tw);
+
+    Exec_Status status = EXEC_LIMIT;
+    size_t produced = 0;
+    size_t consumed = 0;
+    while (e->steps < limit) {
+        size_t head = e->head;
+        status = exec_step(e);
+        if (status != EXEC_OK) break;
+        status = EXEC_LIMIT;
+
+        while (produced - consumed == TRACE_RING_CAPACITY) {
+            consumed = atomic_load_explicit(&tw.consumed, memory_order_acquire);
+            if (produced - consumed == TRACE_RING_CAPACITY) sched_yield();
+        }
+        tw.records[produced&(TRACE_RING_CAPACITY - 1)] = (Trace_Record) {
+            .write = exec_cell(e, head),
+            .state = e->state,
+            .delta = (int32_t) (e->head - head),
+        };
+        produced += 1;
+        atomic_store_explicit(&tw.produced, produced, memory_order_release);
+    }
+
+    atomic_store_explicit(&tw.done, true, memory_order_release);
+    pthread_join(thread, NULL);
+
+    free(tw.records);
+    free(tw.tape.data);
+    free(tw.runs.data);
+    free(tw.out.data);
+    return status;
+}
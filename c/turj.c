@@ -1,6 +1,18 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 
 typedef int Errno;
 
@@ -117,9 +129,37 @@ typedef struct {
     size_t capacity;
 } Rules;
 
+typedef enum {
+    // Pushes the set named by the token
+    SET_OP_NAME,
+    // Pushes the empty set
+    SET_OP_EMPTY,
+    // Adds the symbol of the token to the set on the top
+    SET_OP_INSERT,
+    SET_OP_UNION,
+    SET_OP_DIFFERENCE,
+    SET_OP_INTERSECTION,
+} Set_Op_Kind;
+
+typedef struct {
+    Set_Op_Kind kind;
+    Token token;
+} Set_Op;
+
+// Set expression in the postfix order: `Bit | {'#'}` is NAME(Bit) EMPTY INSERT('#') UNION
+typedef struct {
+    Set_Op *data;
+    size_t count;
+    size_t capacity;
+} Set_Expr;
+
 typedef struct {
     Token name;
+    Set_Expr expr;
+    // The symbols of the set in the order of their first appearance. Evaluated from the `expr`
+    // by set_evaluate() before the set is used.
     Tokens items;
+    bool evaluated;
 } Set;
 
 typedef struct {
@@ -128,11 +168,36 @@ typedef struct {
     size_t capacity;
 } Sets;
 
+typedef struct {
+    Token symbol;
+    // How many times the symbol (or the group) is repeated
+    size_t count;
+    // Amount of the segments right after this one that form the repeated group.
+    // Zero if this segment is just a symbol.
+    size_t group;
+} Tape_Segment;
+
+typedef struct {
+    Tape_Segment *data;
+    size_t count;
+    size_t capacity;
+} Tape_Segments;
+
 typedef struct {
     Token state;
-    Tokens tape;
+    Tape_Segments tape;
+    // `#run Entry @file` takes the initial tape from the file instead. Every byte of the file
+    // is a symbol. The file is mapped into the memory by machine_compile() and unmapped by
+    // run_unmap_file() once the initial tape was built from it.
+    Token file;
+    const uint8_t *file_data;
+    size_t file_size;
     Token init;
     Loc loc;
+    // `#nrun` treats the rules with the same State and Read as nondeterministic branches
+    // and searches for the `accept` state
+    bool nondeterministic;
+    Token accept;
 } Run;
 
 typedef struct {
@@ -141,12 +206,87 @@ typedef struct {
     size_t capacity;
 } Runs;
 
+typedef struct {
+    Token state;
+    Token read;
+    // `#break State` without the Symbol stops on every symbol
+    bool any_read;
+    Loc loc;
+} Breakpoint;
+
+typedef struct {
+    Breakpoint *data;
+    size_t count;
+    size_t capacity;
+} Breakpoints;
+
+typedef struct {
+    size_t cell;
+    Loc loc;
+} Watch;
+
+typedef struct {
+    Watch *data;
+    size_t count;
+    size_t capacity;
+} Watches;
+
+// A `for` clause that could not be expanded while parsing a chunk of the file
+typedef struct {
+    Rule rule;
+    Token symbol;
+    Set_Expr set;
+    // How many rules and sets the chunk had at the point of the clause
+    size_t rules_count;
+    size_t sets_count;
+} Pending_For;
+
+typedef struct {
+    Pending_For *data;
+    size_t count;
+    size_t capacity;
+} Pending_Fors;
+
 typedef struct {
     Rules rules;
     Sets sets;
     Runs runs;
+    Breakpoints breakpoints;
+    Watches watches;
+    Pending_Fors pending_fors;
 } Top_Level;
 
+#include "machine.c"
+#include "history.c"
+#include "debugger.c"
+#include "nrun.c"
+#include "cache.c"
+#include "trace.c"
+#include "stats.c"
+
+void top_level_free(Top_Level *tl)
+{
+    for (size_t i = 0; i < tl->sets.count; ++i) {
+        free(tl->sets.data[i].expr.data);
+        free(tl->sets.data[i].items.data);
+    }
+    for (size_t i = 0; i < tl->runs.count; ++i) {
+        free(tl->runs.data[i].tape.data);
+        run_unmap_file(&tl->runs.data[i]);
+    }
+    for (size_t i = 0; i < tl->pending_fors.count; ++i) free(tl->pending_fors.data[i].set.data);
+    free(tl->rules.data);
+    free(tl->sets.data);
+    free(tl->runs.data);
+    free(tl->breakpoints.data);
+    free(tl->watches.data);
+    free(tl->pending_fors.data);
+    memset(tl, 0, sizeof(*tl));
+}
+
+// The speculative parses of the chunks stay silent. If the error is real the chunk is parsed
+// again to report it.
+#define parse_error(l, ...) do { if (!(l)->speculative) printf(__VA_ARGS__); } while (0)
 
 bool lexer_expect_token_(Lexer *l, Token *t, Token_Mask mask)
 {
@@ -161,12 +301,13 @@ bool lexer_expect_token_(Lexer *l, Token *t, Token_Mask mask)
             String_Builder sb = {0};
             for (Token_Kind kind = 0; kind < COUNT_TK; ++kind) {
                 if (!(mask&(1<<kind))) continue;
-                if (kind > 0) sb_append_cstr(&sb, " or ");
+                if (sb.count > 0) sb_append_cstr(&sb, " or ");
                 sb_append_cstr(&sb, token_kind_display(kind, __FILE__, __LINE__));
             }
 
-            printf(Loc_Fmt": ERROR: expected "SB_Fmt" but got %s\n",
+            parse_error(l, Loc_Fmt": ERROR: expected "SB_Fmt" but got %s\n",
                    Loc_Arg(t->loc), SB_Arg(sb), token_kind_display(t->kind, __FILE__, __LINE__));
+            free(sb.data);
             return false;
         } break;
         case LR_END:
@@ -176,11 +317,12 @@ bool lexer_expect_token_(Lexer *l, Token *t, Token_Mask mask)
             for (Token_Kind kind = 0; kind < COUNT_TK; ++kind) {
                 Token_Kind it = mask&(1<<kind);
                 if (!it) continue;
-                if (kind > 0) sb_append_cstr(&sb, " or ");
+                if (sb.count > 0) sb_append_cstr(&sb, " or ");
                 sb_append_cstr(&sb, token_kind_display(kind, __FILE__, __LINE__));
             }
 
-            printf(Loc_Fmt": ERROR: expected "SB_Fmt" but got %s\n", Loc_Arg(t->loc), SB_Arg(sb), lexer_result_display(result));
+            parse_error(l, Loc_Fmt": ERROR: expected "SB_Fmt" but got %s\n", Loc_Arg(t->loc), SB_Arg(sb), lexer_result_display(result));
+            free(sb.data);
             return false;
         } break;
 
@@ -200,6 +342,333 @@ Rule rule_from_template(Rule temp, Token symbol, Token replace)
     return instance;
 }
 
+// # Set Algebra
+//
+// The set expressions are evaluated on the bitsets over the ids of their symbols. The ids are
+// interned for every evaluation separately, so an expression does not depend on anything but
+// the sets it names. The order of the symbols is kept along with the bitset, because the rules
+// are instantiated in that order and the first matching rule wins.
+
+typedef struct {
+    // The ids in the order of their first appearance
+    Symbol_Id *data;
+    size_t count;
+    size_t capacity;
+    uint64_t *bits;
+    size_t words;
+} Set_Value;
+
+typedef struct {
+    Set_Value *data;
+    size_t count;
+    size_t capacity;
+} Set_Values;
+
+typedef struct {
+    Symbols symbols;
+    // The first occurrence of every interned symbol
+    Tokens tokens;
+    Set_Values stack;
+} Set_Eval;
+
+static bool set_value_has(const Set_Value *v, Symbol_Id id)
+{
+    return id/64 < v->words && (v->bits[id/64]>>(id%64))&1;
+}
+
+static void set_value_insert(Set_Value *v, Symbol_Id id)
+{
+    if (set_value_has(v, id)) return;
+    if (id/64 >= v->words) {
+        size_t words = id/64 + 1;
+        v->bits = realloc(v->bits, words*sizeof(*v->bits));
+        assert(v->bits != NULL && "Buy more RAM lol");
+        memset(v->bits + v->words, 0, (words - v->words)*sizeof(*v->bits));
+        v->words = words;
+    }
+    v->bits[id/64] |= 1ULL<<(id%64);
+    da_append(v, id);
+}
+
+static void set_value_free(Set_Value *v)
+{
+    free(v->data);
+    free(v->bits);
+}
+
+static Symbol_Id set_eval_intern(Set_Eval *ev, Token token)
+{
+    size_t count = ev->symbols.count;
+    Symbol_Id id = symbols_intern(&ev->symbols, token.text);
+    if (id == count) da_append(&ev->tokens, token);
+    return id;
+}
+
+bool set_evaluate(Top_Level *tl, size_t index);
+
+// Looks the set up among the first `sets_count` sets. Returns its index or -1.
+static long set_find(const Top_Level *tl, String_View name, size_t sets_count)
+{
+    for (size_t i = 0; i < sets_count; ++i) {
+        if (sv_eq(tl->sets.data[i].name.text, name)) return i;
+    }
+    return -1;
+}
+
+// Evaluates the expression into `items`, looking the names up among the first `sets_count` sets
+static bool set_expr_eval(Top_Level *tl, const Set_Expr *expr, size_t sets_count, Tokens *items)
+{
+    bool result = true;
+    Set_Eval ev = {0};
+
+    for (size_t i = 0; i < expr->count; ++i) {
+        Set_Op op = expr->data[i];
+        switch (op.kind) {
+        case SET_OP_NAME: {
+            long index = set_find(tl, op.token.text, sets_count);
+            if (index < 0) {
+                printf(Loc_Fmt": ERROR: set "SV_Fmt" does not exist\n", Loc_Arg(op.token.loc), SV_Arg(op.token.text));
+                return_defer(false);
+            }
+            if (!set_evaluate(tl, index)) return_defer(false);
+
+            Set_Value value = {0};
+            const Tokens *named = &tl->sets.data[index].items;
+            for (size_t j = 0; j < named->count; ++j) set_value_insert(&value, set_eval_intern(&ev, named->data[j]));
+            da_append(&ev.stack, value);
+        } break;
+
+        case SET_OP_EMPTY:
+            da_append(&ev.stack, (Set_Value) {0});
+            break;
+
+        case SET_OP_INSERT:
+            assert(ev.stack.count >= 1);
+            set_value_insert(&ev.stack.data[ev.stack.count - 1], set_eval_intern(&ev, op.token));
+            break;
+
+        case SET_OP_UNION:
+        case SET_OP_DIFFERENCE:
+        case SET_OP_INTERSECTION: {
+            assert(ev.stack.count >= 2);
+            Set_Value b = ev.stack.data[--ev.stack.count];
+            Set_Value *a = &ev.stack.data[ev.stack.count - 1];
+            if (op.kind == SET_OP_UNION) {
+                for (size_t j = 0; j < b.count; ++j) set_value_insert(a, b.data[j]);
+            } else {
+                // The symbols of the left operand that are (or are not) in the right one
+                bool keep = op.kind == SET_OP_INTERSECTION;
+                Set_Value c = {0};
+                for (size_t j = 0; j < a->count; ++j) {
+                    if (set_value_has(&b, a->data[j]) == keep) set_value_insert(&c, a->data[j]);
+                }
+                set_value_free(a);
+                *a = c;
+            }
+            set_value_free(&b);
+        } break;
+
+        default: UNREACHABLE("Unknown Set_Op_Kind");
+        }
+    }
+
+    assert(ev.stack.count == 1);
+    const Set_Value *value = &ev.stack.data[0];
+    items->count = 0;
+    for (size_t i = 0; i < value->count; ++i) da_append(items, ev.tokens.data[value->data[i]]);
+
+defer:
+    for (size_t i = 0; i < ev.stack.count; ++i) set_value_free(&ev.stack.data[i]);
+    free(ev.stack.data);
+    free(ev.symbols.data);
+    free(ev.symbols.buckets);
+    free(ev.tokens.data);
+    return result;
+}
+
+// Evaluates the set definition unless it already was. A set may only refer to the sets defined
+// before it.
+bool set_evaluate(Top_Level *tl, size_t index)
+{
+    Set *set = &tl->sets.data[index];
+    if (set->evaluated) return true;
+    if (!set_expr_eval(tl, &set->expr, index, &set->items)) return false;
+    set->evaluated = true;
+    return true;
+}
+
+// Instantiates the rule template for every symbol of the set expression, looking the sets up
+// among the first `sets_count` sets
+bool expand_for(Top_Level *tl, Rule rule, Token symbol, const Set_Expr *set, size_t sets_count)
+{
+    // Just naming a set is by far the most common, so it does not need to copy the set
+    if (set->count == 1 && set->data[0].kind == SET_OP_NAME) {
+        long index = set_find(tl, set->data[0].token.text, sets_count);
+        if (index >= 0) {
+            if (!set_evaluate(tl, index)) return false;
+            const Tokens *items = &tl->sets.data[index].items;
+            for (size_t j = 0; j < items->count; ++j) {
+                da_append(&tl->rules, rule_from_template(rule, symbol, items->data[j]));
+            }
+            return true;
+        }
+    }
+
+    // TODO: nested for-s
+
+    Tokens items = {0};
+    if (!set_expr_eval(tl, set, sets_count, &items)) return false;
+    for (size_t j = 0; j < items.count; ++j) {
+        da_append(&tl->rules, rule_from_template(rule, symbol, items.data[j]));
+    }
+    free(items.data);
+    return true;
+}
+
+// Parses the optional `* Count` after a tape segment
+bool parse_tape_repetition(Lexer *l, size_t *count)
+{
+    Token star;
+    *count = 1;
+    if (lexer_peek(l, &star) != LR_VALID || star.kind != TK_STAR) return true;
+    Lexer_Result result = lexer_next(l, &star);
+    assert(result == LR_VALID);
+
+    Token number;
+    if (!lexer_expect_token_(l, &number, MASK(TK_SYMBOL))) return false;
+    *count = 0;
+    for (size_t i = 0; i < number.text.count; ++i) {
+        if (!isdigit(number.text.data[i])) {
+            parse_error(l, Loc_Fmt": ERROR: repetition count must be a positive integer, but got "SV_Fmt"\n", Loc_Arg(number.loc), SV_Arg(number.text));
+            return false;
+        }
+        size_t digit = number.text.data[i] - '0';
+        if (*count > (SIZE_MAX - digit)/10) {
+            parse_error(l, Loc_Fmt": ERROR: repetition count "SV_Fmt" is too big, it may be at most %zu\n", Loc_Arg(number.loc), SV_Arg(number.text), (size_t) SIZE_MAX);
+            return false;
+        }
+        *count = *count*10 + digit;
+    }
+    if (*count == 0) {
+        parse_error(l, Loc_Fmt": ERROR: repetition count must be a positive integer, but got "SV_Fmt"\n", Loc_Arg(number.loc), SV_Arg(number.text));
+        return false;
+    }
+    return true;
+}
+
+// Parses the tape literal after the opening bracket up to and including the closing one.
+// Symbols and nested groups of them may be repeated with `* Count`: `[1*100000 [0 1]*8 '#' 0]`
+bool parse_tape(Lexer *l, Tape_Segments *tape)
+{
+    while (true) {
+        Token token;
+        if (!lexer_expect_token_(l, &token, MASK(TK_SYMBOL) | MASK(TK_OBRACKET) | MASK(TK_CBRACKET))) return false;
+
+        switch (token.kind) {
+        case TK_CBRACKET: return true;
+
+        case TK_SYMBOL: {
+            Tape_Segment segment = { .symbol = token };
+            if (!parse_tape_repetition(l, &segment.count)) return false;
+            da_append(tape, segment);
+        } break;
+
+        case TK_OBRACKET: {
+            size_t index = tape->count;
+            da_append(tape, ((Tape_Segment) { .symbol = token }));
+            if (!parse_tape(l, tape)) return false;
+            tape->data[index].group = tape->count - index - 1;
+            if (tape->data[index].group == 0) {
+                parse_error(l, Loc_Fmt": ERROR: tape group may not be empty\n", Loc_Arg(token.loc));
+                return false;
+            }
+            if (!parse_tape_repetition(l, &tape->data[index].count)) return false;
+        } break;
+
+        default:
+            UNREACHABLE("unexpected token");
+        }
+    }
+}
+
+bool parse_set_expr(Lexer *l, Set_Expr *expr);
+
+// Set     = Name / '{' *Symbol '}' / '(' SetExpr ')'
+bool parse_set(Lexer *l, Set_Expr *expr)
+{
+    Token token;
+    if (!lexer_expect_token_(l, &token, MASK(TK_SYMBOL) | MASK(TK_OCURLY) | MASK(TK_OPAREN))) return false;
+
+    switch (token.kind) {
+    case TK_SYMBOL:
+        da_append(expr, ((Set_Op) { SET_OP_NAME, token }));
+        return true;
+
+    case TK_OCURLY: {
+        da_append(expr, ((Set_Op) { SET_OP_EMPTY, token }));
+
+        Token next;
+        Lexer_Result result = lexer_next(l, &next);
+        while (result == LR_VALID && next.kind == TK_SYMBOL) {
+            da_append(expr, ((Set_Op) { SET_OP_INSERT, next }));
+            result = lexer_next(l, &next);
+        }
+
+        if (result != LR_VALID) {
+            parse_error(l, Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(next.loc), token_kind_display(TK_CCURLY, __FILE__, __LINE__), lexer_result_display(result));
+            return false;
+        }
+
+        if (next.kind != TK_CCURLY) {
+            parse_error(l, Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(next.loc),
+                  token_kind_display(TK_CCURLY, __FILE__, __LINE__),
+                  token_kind_display(next.kind, __FILE__, __LINE__));
+            return false;
+        }
+        return true;
+    }
+
+    case TK_OPAREN: {
+        if (!parse_set_expr(l, expr)) return false;
+        Token cparen;
+        return lexer_expect_token_(l, &cparen, MASK(TK_CPAREN));
+    }
+
+    default:
+        UNREACHABLE("unexpected token");
+    }
+}
+
+// SetTerm = Set *('&' Set)
+bool parse_set_term(Lexer *l, Set_Expr *expr)
+{
+    if (!parse_set(l, expr)) return false;
+
+    Token op;
+    while (lexer_peek(l, &op) == LR_VALID && op.kind == TK_AMPERSAND) {
+        Lexer_Result result = lexer_next(l, &op);
+        assert(result == LR_VALID);
+        if (!parse_set(l, expr)) return false;
+        da_append(expr, ((Set_Op) { SET_OP_INTERSECTION, op }));
+    }
+    return true;
+}
+
+// SetExpr = SetTerm *(('|' / '-') SetTerm)
+bool parse_set_expr(Lexer *l, Set_Expr *expr)
+{
+    if (!parse_set_term(l, expr)) return false;
+
+    Token op;
+    while (lexer_peek(l, &op) == LR_VALID && (op.kind == TK_PIPE || op.kind == TK_MINUS)) {
+        Lexer_Result result = lexer_next(l, &op);
+        assert(result == LR_VALID);
+        if (!parse_set_term(l, expr)) return false;
+        da_append(expr, ((Set_Op) { op.kind == TK_PIPE ? SET_OP_UNION : SET_OP_DIFFERENCE, op }));
+    }
+    return true;
+}
+
 bool parse_top_level(Top_Level *tl, Lexer *l)
 {
     Token first;
@@ -207,39 +676,86 @@ bool parse_top_level(Top_Level *tl, Lexer *l)
 
     switch (first.kind) {
     case TK_COMMAND: {
-        if (sv_eq(first.text, SV("#run"))) {
+        if (sv_eq(first.text, SV("#run")) || sv_eq(first.text, SV("#nrun"))) {
             Run run = {
                 .loc = first.loc,
+                .nondeterministic = sv_eq(first.text, SV("#nrun")),
             };
 
             if (!lexer_expect_token_(l, &run.state, MASK(TK_SYMBOL))) return false;
-            if (!lexer_expect_token_(l, &first, MASK(TK_OBRACKET))) return false;
+            if (run.nondeterministic && !lexer_expect_token_(l, &run.accept, MASK(TK_SYMBOL))) return false;
+            if (!lexer_expect_token_(l, &first, MASK(TK_OBRACKET) | MASK(TK_FILE))) return false;
 
-            Lexer_Result result = lexer_next(l, &first);
-            while (result == LR_VALID && first.kind != TK_CBRACKET) {
-                da_append(&run.tape, first);
-                result = lexer_next(l, &first);
+            if (first.kind == TK_FILE) {
+                if (first.text.count == 0) {
+                    parse_error(l, Loc_Fmt": ERROR: expected the path to the tape file after @\n", Loc_Arg(first.loc));
+                    return false;
+                }
+                run.file = first;
+            } else {
+                if (!parse_tape(l, &run.tape)) {
+                    free(run.tape.data);
+                    return false;
+                }
+
+                if (run.tape.count == 0) {
+                    parse_error(l, Loc_Fmt": ERROR: tape may not be empty, because we are using the last symbol as the symbol the entire infinite tape is initialized with.\n", Loc_Arg(first.loc));
+                    free(run.tape.data);
+                    return false;
+                }
+                // The last segment is never a group, because the groups may not be empty
+                run.init = run.tape.data[run.tape.count - 1].symbol;
             }
 
-            if (result != LR_VALID) {
-                printf(Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(first.loc), token_kind_display(TK_CBRACKET, __FILE__, __LINE__), lexer_result_display(result));
-                return false;
-            } else if (first.kind != TK_CBRACKET) {
-                printf(Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(first.loc), token_kind_display(TK_CBRACKET, __FILE__, __LINE__), token_kind_display(first.kind, __FILE__, __LINE__));
-                return false;
+            da_append(&tl->runs, run);
+
+            return true;
+        } else if (sv_eq(first.text, SV("#break"))) {
+            Breakpoint breakpoint = {
+                .loc = first.loc,
+                .any_read = true,
+            };
+
+            if (!lexer_expect_token_(l, &breakpoint.state, MASK(TK_SYMBOL))) return false;
+
+            // The Symbol is optional, so it only belongs to the breakpoint if it is on the same line.
+            // Otherwise it's the beginning of the next Rule.
+            Token read;
+            if (lexer_peek(l, &read) == LR_VALID && read.kind == TK_SYMBOL && read.loc.row == breakpoint.state.loc.row) {
+                Lexer_Result result = lexer_next(l, &read);
+                assert(result == LR_VALID);
+                breakpoint.read = read;
+                breakpoint.any_read = false;
             }
 
-            if (run.tape.count == 0) {
-                printf(Loc_Fmt": ERROR: tape may not be empty, because we are using the last symbol as the symbol the entire infinite tape is initialized with.\n", Loc_Arg(first.loc));
+            da_append(&tl->breakpoints, breakpoint);
+            return true;
+        } else if (sv_eq(first.text, SV("#watch"))) {
+            Watch watch = {
+                .loc = first.loc,
+            };
+
+            Token what;
+            if (!lexer_expect_token_(l, &what, MASK(TK_SYMBOL))) return false;
+            if (!sv_eq(what.text, SV("cell"))) {
+                parse_error(l, Loc_Fmt": ERROR: unknown watch target "SV_Fmt". Only `cell` is supported\n", Loc_Arg(what.loc), SV_Arg(what.text));
                 return false;
             }
-            run.init = run.tape.data[run.tape.count - 1];
 
-            da_append(&tl->runs, run);
+            Token index;
+            if (!lexer_expect_token_(l, &index, MASK(TK_SYMBOL))) return false;
+            for (size_t i = 0; i < index.text.count; ++i) {
+                if (!isdigit(index.text.data[i])) {
+                    parse_error(l, Loc_Fmt": ERROR: cell index must be a non-negative integer, but got "SV_Fmt"\n", Loc_Arg(index.loc), SV_Arg(index.text));
+                    return false;
+                }
+            }
+            watch.cell = sv_to_u64(index.text);
 
+            da_append(&tl->watches, watch);
             return true;
         } else {
-            printf(Loc_Fmt": ERROR: unknown command "SV_Fmt"\n", Loc_Arg(first.loc), SV_Arg(first.text));
+            parse_error(l, Loc_Fmt": ERROR: unknown command "SV_Fmt"\n", Loc_Arg(first.loc), SV_Arg(first.text));
             return false;
         }
     }
@@ -270,26 +786,29 @@ bool parse_top_level(Top_Level *tl, Lexer *l)
                 Token colon;
                 if (!lexer_expect_token_(l, &colon, MASK(TK_COLON))) return false;
 
-                // TODO: introduce the notion of Set expressions and parse the Set expression next in here
-                Token set;
-                if (!lexer_expect_token_(l, &set, MASK(TK_SYMBOL))) return false;
-
-                // TODO: defer the expansion of `for` so we can define sets anywhere
-                for (size_t i = 0; i < tl->sets.count; ++i) {
-                    Set *it = &tl->sets.data[i];
-                    if (sv_eq(it->name.text, set.text)) {
-                        for (size_t j = 0; j < it->items.count; ++j) {
-                            Token jt = it->items.data[j];
-                            da_append(&tl->rules, rule_from_template(rule, symbol, jt));
-                        }
-                        return true;
-                    }
+                Set_Expr set = {0};
+                if (!parse_set_expr(l, &set)) {
+                    free(set.data);
+                    return false;
                 }
 
-                // TODO: nested for-s
+                if (l->speculative) {
+                    // The set may be defined in one of the earlier chunks, so the rule is expanded
+                    // when the chunks are merged
+                    da_append(&tl->pending_fors, ((Pending_For) {
+                        .rule = rule,
+                        .symbol = symbol,
+                        .set = set,
+                        .rules_count = tl->rules.count,
+                        .sets_count = tl->sets.count,
+                    }));
+                    return true;
+                }
 
-                printf(Loc_Fmt": ERROR: set "SV_Fmt" does not exist\n", Loc_Arg(set.loc), SV_Arg(set.text));
-                return false;
+                // TODO: defer the expansion of `for` so we can define sets anywhere
+                bool expanded = expand_for(tl, rule, symbol, &set, tl->sets.count);
+                free(set.data);
+                return expanded;
             } else {
                 da_append(&tl->rules, rule);
                 return true;
@@ -302,31 +821,16 @@ bool parse_top_level(Top_Level *tl, Lexer *l)
                 .name = first,
             };
 
-            Token curly;
-            if (!lexer_expect_token_(l, &curly, MASK(TK_OCURLY))) return false;
-
-            Token next;
-            Lexer_Result result = lexer_next(l, &next);
-            while (result == LR_VALID && next.kind == TK_SYMBOL) {
-                // TODO: check if the symbols are unique
-                da_append(&set.items, next);
-                result = lexer_next(l, &next);
-            }
-
-            if (result != LR_VALID) {
-                printf(Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(next.loc), token_kind_display(TK_CCURLY, __FILE__, __LINE__), lexer_result_display(result));
-                return false;
-            }
-
-            if (next.kind != TK_CCURLY) {
-                printf(Loc_Fmt": ERROR: expected %s but got %s\n", Loc_Arg(next.loc),
-                      token_kind_display(TK_CCURLY, __FILE__, __LINE__),
-                      token_kind_display(next.kind, __FILE__, __LINE__));
+            if (!parse_set_expr(l, &set.expr)) {
+                free(set.expr.data);
                 return false;
             }
 
             da_append(&tl->sets, set);
-            return true;
+            // The sets of a chunk may refer to the sets of the earlier chunks, so they are
+            // evaluated when the chunks are merged
+            if (l->speculative) return true;
+            return set_evaluate(tl, tl->sets.count - 1);
         }
         break;
 
@@ -341,60 +845,282 @@ bool parse_top_level(Top_Level *tl, Lexer *l)
     }
 }
 
-void execute_run(Run *run, Rule *rules, size_t rules_count) {
-    printf(Loc_Fmt": #run\n", Loc_Arg(run->loc));
+// Parses the top level items that begin before `end`. Like the whole file, the chunk ends early
+// on the first token the lexer does not recognize.
+bool parse_until(Top_Level *tl, Lexer *l, size_t end)
+{
+    Token first;
+    while (lexer_peek(l, &first) == LR_VALID && l->token_start < end) {
+        if (!parse_top_level(tl, l)) return false;
+    }
+    return true;
+}
 
-    int head = 0;
+// # Parallel Parsing
+//
+// The generated programs with millions of rules are split into chunks at the line boundaries
+// and the chunks are parsed in parallel. A line boundary is not necessarily an item boundary,
+// so the chunks are parsed speculatively and then merged in order. A chunk is accepted only if
+// its first item begins exactly where the previous chunk stopped. Then the lexer has the same
+// state as it would have in the sequential parse and so do the parsed items with their Locs.
+// Otherwise the chunk is parsed again sequentially right after the previous one, which also
+// reports the errors exactly as the sequential parse does.
 
-    while (true) {
-        assert(head >= 0);
-        while ((size_t) head >= run->tape.count) {
-            da_append(&run->tape, run->init);
+#define PARSE_CHUNK_MIN_SIZE (1<<20)
+
+typedef struct {
+    String_View content;
+    String_View file_path;
+    size_t start;
+    size_t end;
+    // Amount of lines before the start of the chunk. The first pass counts the lines within
+    // the chunk in here.
+    size_t row;
+
+    Top_Level tl;
+    Lexer lexer;
+    // Where the first item of the chunk begins
+    size_t first;
+    bool failed;
+} Parse_Chunk;
+
+static void *parse_chunk_count_lines(void *arg)
+{
+    Parse_Chunk *c = arg;
+    const char *it = c->content.data + c->start;
+    const char *end = c->content.data + c->end;
+    size_t rows = 0;
+    while ((it = memchr(it, '\n', end - it)) != NULL) {
+        rows += 1;
+        it += 1;
+    }
+    c->row = rows;
+    return NULL;
+}
+
+static void *parse_chunk(void *arg)
+{
+    Parse_Chunk *c = arg;
+    c->lexer = lexer_from_string(c->content, c->file_path);
+    c->lexer.cur = c->start;
+    c->lexer.bol = c->start;
+    c->lexer.row = c->row;
+    c->lexer.speculative = true;
+
+    Token first;
+    lexer_peek(&c->lexer, &first);
+    c->first = c->lexer.token_start;
+    c->failed = !parse_until(&c->tl, &c->lexer, c->end);
+    return NULL;
+}
+
+// Appends the items of the chunk to `tl` evaluating its sets and expanding its pending `for`s in
+// the order they appear in the file, so the first error is the same as in the sequential parse
+static bool parse_chunk_merge(Top_Level *tl, const Top_Level *chunk)
+{
+    size_t sets_count = tl->sets.count;
+    da_append_many(&tl->sets, chunk->sets.data, chunk->sets.count);
+    da_append_many(&tl->runs, chunk->runs.data, chunk->runs.count);
+    da_append_many(&tl->breakpoints, chunk->breakpoints.data, chunk->breakpoints.count);
+    da_append_many(&tl->watches, chunk->watches.data, chunk->watches.count);
+
+    size_t rules_count = 0;
+    size_t evaluated = sets_count;
+    for (size_t i = 0; i < chunk->pending_fors.count; ++i) {
+        Pending_For *it = &chunk->pending_fors.data[i];
+        for (; evaluated < sets_count + it->sets_count; ++evaluated) {
+            if (!set_evaluate(tl, evaluated)) return false;
         }
+        size_t count = it->rules_count - rules_count;
+        da_append_many(&tl->rules, chunk->rules.data + rules_count, count);
+        rules_count = it->rules_count;
+        if (!expand_for(tl, it->rule, it->symbol, &it->set, sets_count + it->sets_count)) return false;
+    }
+    for (; evaluated < tl->sets.count; ++evaluated) {
+        if (!set_evaluate(tl, evaluated)) return false;
+    }
+    size_t count = chunk->rules.count - rules_count;
+    da_append_many(&tl->rules, chunk->rules.data + rules_count, count);
+    return true;
+}
 
-        String_Builder sb = {0};
-        sb_append_buf(&sb, run->state.text.data, run->state.text.count);
-        sb_append_cstr(&sb, ":");
-
-        size_t head_start = 0;
-        size_t head_end = 0;
-        for (size_t i = 0; i < run->tape.count; ++i) {
-            Token it = run->tape.data[i];
-            if (i == (size_t) head) head_start = sb.count + 1;
-            sb_append_cstr(&sb, " ");
-            sb_append_buf(&sb, it.text.data, it.text.count);
-            if (i == (size_t) head) head_end = sb.count;
+// Parses the content split into `chunks_count` chunks however small they are
+bool parse_program_chunked(Top_Level *tl, String_View content, String_View file_path, size_t chunks_count)
+{
+    Lexer lexer = lexer_from_string(content, file_path);
+    if (chunks_count <= 1) return parse_until(tl, &lexer, content.count);
+
+    Parse_Chunk *chunks = calloc(chunks_count, sizeof(*chunks));
+    pthread_t *threads = calloc(chunks_count, sizeof(*threads));
+    assert(chunks != NULL && threads != NULL && "Buy more RAM lol");
+    for (size_t i = 0; i < chunks_count; ++i) {
+        Parse_Chunk *c = &chunks[i];
+        c->content = content;
+        c->file_path = file_path;
+        if (i > 0) {
+            c->start = i*(content.count/chunks_count);
+            if (c->start < chunks[i - 1].start) c->start = chunks[i - 1].start;
+            const char *newline = memchr(content.data + c->start, '\n', content.count - c->start);
+            c->start = newline ? (size_t) (newline - content.data) + 1 : content.count;
+            chunks[i - 1].end = c->start;
         }
-        printf(SB_Fmt"\n", SB_Arg(sb));
-        for (size_t i = 0; i < head_start; ++i) printf(" ");
-        for (size_t i = head_start; i < head_end; ++i) printf("^");
-        printf("\n");
-
-        for (size_t i = 0; i < rules_count; ++i) {
-            Rule *it = &rules[i];
-            if (sv_eq(it->state.text, run->state.text) && sv_eq(it->read.text, run->tape.data[head].text)) {
-                run->tape.data[head] = it->write;
-                run->state           = it->next;
-                if (sv_eq(it->step.text, SV("<-"))) {
-                    head -= 1;
-                } else if (sv_eq(it->step.text, SV("->"))) {
-                    head += 1;
-                } else {
-                    UNREACHABLE("Unexpected arrow symbol");
-                }
-                if (head < 0) goto break_loop;
-                goto continue_loop;
+    }
+    chunks[chunks_count - 1].end = content.count;
+
+    for (size_t i = 0; i < chunks_count; ++i) pthread_create(&threads[i], NULL, parse_chunk_count_lines, &chunks[i]);
+    for (size_t i = 0; i < chunks_count; ++i) pthread_join(threads[i], NULL);
+    size_t row = 0;
+    for (size_t i = 0; i < chunks_count; ++i) {
+        size_t rows = chunks[i].row;
+        chunks[i].row = row;
+        row += rows;
+    }
+
+    for (size_t i = 0; i < chunks_count; ++i) pthread_create(&threads[i], NULL, parse_chunk, &chunks[i]);
+    for (size_t i = 0; i < chunks_count; ++i) pthread_join(threads[i], NULL);
+
+    bool result = true;
+    Token first;
+    lexer_peek(&lexer, &first);
+    for (size_t i = 0; i < chunks_count; ++i) {
+        Parse_Chunk *c = &chunks[i];
+        bool merged = false;
+        if (result && lexer.peek_result == LR_VALID) {
+            if (!c->failed && c->first == lexer.token_start) {
+                result = parse_chunk_merge(tl, &c->tl);
+                merged = true;
+                lexer = c->lexer;
+                lexer.speculative = false;
+            } else {
+                result = parse_until(tl, &lexer, c->end);
             }
         }
-        goto break_loop;
-continue_loop: {}
+
+        // The merge moves the sets and the runs of the chunk into `tl` along with everything
+        // they own, even if it fails half way. Nothing else of the chunk is needed anymore.
+        if (merged) {
+            for (size_t j = 0; j < c->tl.pending_fors.count; ++j) free(c->tl.pending_fors.data[j].set.data);
+            free(c->tl.rules.data);
+            free(c->tl.sets.data);
+            free(c->tl.runs.data);
+            free(c->tl.breakpoints.data);
+            free(c->tl.watches.data);
+            free(c->tl.pending_fors.data);
+        } else {
+            top_level_free(&c->tl);
+        }
+    }
+
+    free(chunks);
+    free(threads);
+    return result;
+}
+
+bool parse_program(Top_Level *tl, String_View content, String_View file_path)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t chunks_count = content.count/PARSE_CHUNK_MIN_SIZE;
+    if (cpus > 0 && chunks_count > (size_t) cpus) chunks_count = cpus;
+    return parse_program_chunked(tl, content, file_path, chunks_count);
+}
+
+typedef struct {
+    // Print only the final configuration instead of the full trace
+    bool quiet;
+    // Cache the results of the quiet runs in this directory
+    Cache *cache;
+    // Keep the tape in a memory mapped file instead of the heap when the path is not NULL
+    Tape_Spill tape_spill;
+    // How the configurations are printed
+    Trace_Format trace;
+    // Counts of the steps taken from every (state, symbol) when profiling
+    uint64_t *profile;
+    // Collects how every run uses its tape when not NULL
+    Runs_Stats *tape_stats;
+} Options;
+
+void execute_run(Run *run, const Machine *m, const Top_Level *tl, const Options *options)
+{
+    printf(Loc_Fmt": #run\n", Loc_Arg(run->loc));
+
+    Exec e;
+    if (!exec_from_run(m, run, options->tape_spill.path ? &options->tape_spill : NULL, &e)) exit(1);
+    run_unmap_file(run);
+    e.counts = options->profile;
+    if (options->tape_stats) {
+        da_append(options->tape_stats, ((Run_Stats) {
+            .loc = run->loc,
+            .initial_tape_count = exec_tape_count(&e),
+        }));
+        e.stats = &options->tape_stats->data[options->tape_stats->count - 1].stats;
+    }
+
+    if (tl->breakpoints.count > 0 || tl->watches.count > 0) {
+        // Debugging million-step machines with the full trace is not an option
+        Exec_Status status = debug_run(&e, &tl->watches);
+        if (status == EXEC_OK) {
+            printf("-- STOPPED after %"PRIu64" steps --\n", e.steps);
+        } else {
+            printf("-- HALT after %"PRIu64" steps --\n", e.steps);
+        }
+    } else if (options->quiet) {
+        Exec_Status status;
+        Cache_Key key = {0};
+        bool hit = false;
+        // The cached result would skip the run the profile and the statistics are collected from
+        bool cached = options->cache != NULL && e.counts == NULL && e.stats == NULL;
+        if (cached) {
+            key = cache_key(options->cache, &e);
+            hit = cache_load(options->cache, key, &e, &status);
+        }
+        if (!hit) {
+            status = exec_run(&e, UINT64_MAX, NULL);
+            if (cached) cache_store(options->cache, key, &e, status);
+        }
+
+        exec_ensure_head(&e);
+        print_trace_line(&e, &options->trace);
+        printf("-- HALT after %"PRIu64" steps%s --\n", e.steps, hit ? " (cached)" : "");
+    } else {
+        exec_ensure_head(&e);
+        trace_run(&e, UINT64_MAX, STDOUT_FILENO, &options->trace);
+
+        printf("-- HALT --\n");
     }
 
-break_loop:
+    if (e.stats) {
+        Run_Stats *stats = &options->tape_stats->data[options->tape_stats->count - 1];
+        stats->steps = e.steps;
+        stats->tape_count = exec_tape_count(&e);
+    }
+    exec_free(&e);
+}
 
-    printf("-- HALT --\n");
+const char *shift_args(int *argc, char ***argv)
+{
+    assert(*argc > 0);
+    const char *result = **argv;
+    *argc -= 1;
+    *argv += 1;
+    return result;
 }
 
+// Parses the value of a numeric flag, reporting what is wrong with it
+bool parse_count_flag(const char *flag, const char *value, uint64_t *count)
+{
+    char *end = NULL;
+    errno = 0;
+    unsigned long long result = strtoull(value, &end, 10);
+    if (!isdigit(value[0]) || *end != '\0' || errno != 0) {
+        printf("ERROR: %s expects a non-negative integer that fits into 64 bits, but got %s\n", flag, value);
+        return false;
+    }
+    *count = result;
+    return true;
+}
+
+#include "enumerate.c"
+
 Errno file_size(FILE *file, size_t *size)
 {
     long saved = ftell(file);
@@ -434,33 +1160,179 @@ defer:
     return result;
 }
 
+#include "profile.c"
+#include "serve.c"
+#include "fuzz.c"
+
+void usage(const char *program_name)
+{
+    printf("Usage: %s [OPTIONS] <input.turj>\n", program_name);
+    printf("       %s enumerate --states <n> --symbols <m> [OPTIONS]\n", program_name);
+    printf("       %s serve [OPTIONS]\n", program_name);
+    printf("       %s fuzz [OPTIONS]\n", program_name);
+    printf("OPTIONS:\n");
+    printf("    --quiet          print only the final configuration of every #run instead of the full trace\n");
+    printf("    --cache <dir>    cache the results of the quiet runs in <dir>\n");
+    printf("    --tape-spill <path>\n");
+    printf("                     keep the tape in a sparse memory mapped file at <path> instead of RAM\n");
+    printf("    --tape-spill-size <cells>\n");
+    printf("                     reserve room for <cells> cells in the --tape-spill file (default: %zu)\n", TAPE_SPILL_CAPACITY);
+    printf("    --profile-out <path>\n");
+    printf("                     save how many steps every state took on every symbol to <path>\n");
+    printf("    --profile-in <path>\n");
+    printf("                     lay out the transition table by the counts saved with --profile-out\n");
+    printf("    --tape-stats <path>\n");
+    printf("                     save the head position and sweep length histograms and the tape growth of every run as JSON\n");
+    printf("    --trace-rle      collapse the repeated symbols into symbol*count and drop the blank tail\n");
+    printf("    --trace-window <w>\n");
+    printf("                     print only <w> cells on each side of the head\n");
+}
+
 int main(int argc, char **argv)
 {
-    if (argc < 2) {
-        printf("Usage: %s <input.turj>\n", argv[0]);
+    const char *program_name = shift_args(&argc, &argv);
+
+    if (argc > 0 && strcmp(argv[0], "enumerate") == 0) {
+        shift_args(&argc, &argv);
+        return enumerate_main(program_name, argc, argv);
+    }
+
+    if (argc > 0 && strcmp(argv[0], "serve") == 0) {
+        shift_args(&argc, &argv);
+        return serve_main(program_name, argc, argv);
+    }
+
+    if (argc > 0 && strcmp(argv[0], "fuzz") == 0) {
+        shift_args(&argc, &argv);
+        return fuzz_main(program_name, argc, argv);
+    }
+
+    Options options = {0};
+    const char *file_path = NULL;
+    const char *cache_dir = NULL;
+    const char *profile_out = NULL;
+    const char *profile_in = NULL;
+    const char *tape_stats_path = NULL;
+    while (argc > 0) {
+        const char *arg = shift_args(&argc, &argv);
+        if (strcmp(arg, "--quiet") == 0) {
+            options.quiet = true;
+        } else if (strcmp(arg, "--cache") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            cache_dir = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--tape-spill") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            options.tape_spill.path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--tape-spill-size") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            uint64_t cells;
+            if (!parse_count_flag(arg, shift_args(&argc, &argv), &cells)) exit(1);
+            if (cells == 0 || cells > SIZE_MAX/sizeof(Symbol_Id)) {
+                printf("ERROR: %s must be between 1 and %zu cells\n", arg, SIZE_MAX/sizeof(Symbol_Id));
+                exit(1);
+            }
+            options.tape_spill.capacity = cells;
+        } else if (strcmp(arg, "--profile-out") == 0 || strcmp(arg, "--profile-in") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            if (strcmp(arg, "--profile-out") == 0) {
+                profile_out = shift_args(&argc, &argv);
+            } else {
+                profile_in = shift_args(&argc, &argv);
+            }
+        } else if (strcmp(arg, "--tape-stats") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            tape_stats_path = shift_args(&argc, &argv);
+        } else if (strcmp(arg, "--trace-rle") == 0) {
+            options.trace.rle = true;
+        } else if (strcmp(arg, "--trace-window") == 0) {
+            if (argc == 0) {
+                usage(program_name);
+                printf("ERROR: no value was provided for %s\n", arg);
+                exit(1);
+            }
+            uint64_t window;
+            if (!parse_count_flag(arg, shift_args(&argc, &argv), &window)) exit(1);
+            if (window > SIZE_MAX/2) {
+                printf("ERROR: %s may be at most %zu cells\n", arg, SIZE_MAX/2);
+                exit(1);
+            }
+            options.trace.windowed = true;
+            options.trace.window = window;
+        } else if (file_path == NULL) {
+            file_path = arg;
+        } else {
+            usage(program_name);
+            printf("ERROR: unexpected argument %s\n", arg);
+            exit(1);
+        }
+    }
+
+    if (file_path == NULL) {
+        usage(program_name);
         printf("ERROR: no input was provided\n");
         exit(1);
     }
 
-    const char *file_path = argv[1];
     String_Builder content = {0};
     Errno err = read_entire_file(file_path, &content);
     if (err != 0) {
         printf("ERROR: could not read file %s: %s\n", file_path, strerror(err));
         exit(1);
     }
-    Lexer lexer = lexer_from_string(sb_to_sv(content), sv_from_cstr(file_path));
-
     Top_Level top_level = {0};
-    Token first = {0};
-    Lexer_Result result = lexer_peek(&lexer, &first);
-    while (result == LR_VALID) {
-        if (!parse_top_level(&top_level, &lexer)) exit(1);
-        result = lexer_peek(&lexer, &first);
+    if (!parse_program(&top_level, sb_to_sv(content), sv_from_cstr(file_path))) exit(1);
+
+    Machine machine = {0};
+    if (!machine_compile(&machine, &top_level)) exit(1);
+    if (profile_in != NULL && !profile_apply(profile_in, &machine)) exit(1);
+    if (profile_out != NULL) {
+        options.profile = calloc(machine.slots_count, sizeof(*options.profile));
+        assert(options.profile != NULL && "Buy more RAM lol");
+    }
+
+    Cache cache = {0};
+    if (cache_dir != NULL) {
+        cache_init(&cache, cache_dir, &machine);
+        options.cache = &cache;
     }
 
+    Runs_Stats tape_stats = {0};
+    if (tape_stats_path != NULL) options.tape_stats = &tape_stats;
+
     for (size_t i = 0; i < top_level.runs.count; ++i) {
-        execute_run(&top_level.runs.data[i], top_level.rules.data, top_level.rules.count);
+        Run *run = &top_level.runs.data[i];
+        if (run->nondeterministic) {
+            execute_nrun(run, &machine, &top_level);
+        } else {
+            execute_run(run, &machine, &top_level, &options);
+        }
+    }
+
+    if (options.cache) cache_free(options.cache);
+    if (profile_out != NULL && !profile_save(profile_out, &machine, options.profile)) exit(1);
+    if (tape_stats_path != NULL) {
+        if (!runs_stats_save(tape_stats_path, &tape_stats)) exit(1);
+        runs_stats_free(&tape_stats);
     }
 
     return 0;